@@ -1,139 +1,5400 @@
 #include <iostream>
+#include <iomanip>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <unordered_map>
+#include <span>
+#include <random>
+#include <array>
+#include <charconv>
+#include <variant>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <ctime>
+#include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/random.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <immintrin.h>
 #include <limits> // Added for std::numeric_limits
+#include <new>
+#include <malloc.h>
 
-// Account Class: Encapsulates account details and provides methods for deposit, withdrawal, and checking balance
+// Number of operator new calls made by the current thread, read by the self-test to prove
+// that the transaction path never allocates
+thread_local std::uint64_t thread_allocations = 0;
+
+// Replacement allocation functions: plain malloc and free, counting calls per thread. The
+// array and nothrow forms call these, so they are counted too. They are kept out of line
+// so the compiler does not see malloc() and free() paired with operator new and delete.
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    ++thread_allocations;
+    if (void* memory = std::malloc(size != 0 ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void* operator new(std::size_t size, std::align_val_t alignment) {
+    ++thread_allocations;
+    std::size_t align = static_cast<std::size_t>(alignment);
+    if (void* memory = std::aligned_alloc(align, (std::max<std::size_t>(size, 1) + align - 1) / align * align)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+__attribute__((noinline)) void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+__attribute__((noinline)) void operator delete(void* memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+__attribute__((noinline)) void operator delete(void* memory, std::size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+// Money Class: Fixed-point amount stored as a whole number of cents (minor units)
+class Money {
+private:
+    std::int64_t cents;  // Private member to store the amount in cents
+
+    explicit constexpr Money(std::int64_t cents) : cents(cents) {}
+
+public:
+    // Default constructor creates a zero amount
+    constexpr Money() : cents(0) {}
+
+    // Method to create an amount from a number of cents
+    static constexpr Money from_cents(std::int64_t cents) {
+        return Money(cents);
+    }
+
+    // Method to create an amount from whole currency units
+    static constexpr Money from_units(std::int64_t units) {
+        return Money(units * 100);
+    }
+
+    // Largest representable amount, used for overflow checks
+    static constexpr Money max() {
+        return Money(std::numeric_limits<std::int64_t>::max());
+    }
+
+    // Method to get the amount in cents
+    constexpr std::int64_t to_cents() const {
+        return cents;
+    }
+
+    // Method to parse terminal input such as "250", "19.9" or "19.99"
+    static bool parse(std::string_view text, Money& out) {
+        std::int64_t value = 0;
+        std::size_t i = 0;
+        std::size_t digits = 0;
+        const std::int64_t limit = std::numeric_limits<std::int64_t>::max() / 100;
+        while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+            if (value > (limit - (text[i] - '0')) / 10) {
+                return false;
+            }
+            value = value * 10 + (text[i] - '0');
+            ++i;
+            ++digits;
+        }
+        value *= 100;
+        if (i < text.size() && text[i] == '.') {
+            ++i;
+            std::int64_t scale = 10;
+            while (i < text.size() && text[i] >= '0' && text[i] <= '9' && scale > 0) {
+                if (__builtin_add_overflow(value, (text[i] - '0') * scale, &value)) {
+                    return false;
+                }
+                scale /= 10;
+                ++i;
+                ++digits;
+            }
+        }
+        if (digits == 0 || i != text.size()) {
+            return false;
+        }
+        out = Money(value);
+        return true;
+    }
+
+    constexpr bool operator==(Money other) const { return cents == other.cents; }
+    constexpr bool operator!=(Money other) const { return cents != other.cents; }
+    constexpr bool operator<(Money other) const { return cents < other.cents; }
+    constexpr bool operator<=(Money other) const { return cents <= other.cents; }
+    constexpr bool operator>(Money other) const { return cents > other.cents; }
+    constexpr bool operator>=(Money other) const { return cents >= other.cents; }
+
+    constexpr Money operator+(Money other) const { return Money(cents + other.cents); }
+    constexpr Money operator-(Money other) const { return Money(cents - other.cents); }
+    Money& operator+=(Money other) { cents += other.cents; return *this; }
+    Money& operator-=(Money other) { cents -= other.cents; return *this; }
+};
+
+// Function to print an amount as units and two decimal places
+std::ostream& operator<<(std::ostream& os, Money amount) {
+    std::int64_t cents = amount.to_cents();
+    if (cents < 0) {
+        os << '-';
+        cents = -cents;
+    }
+    return os << cents / 100 << '.' << std::setw(2) << std::setfill('0') << cents % 100 << std::setfill(' ');
+}
+
+// Function to format a 128-bit amount of cents, for totals that may not fit in Money
+std::string format_cents(__int128 cents) {
+    bool negative = cents < 0;
+    unsigned __int128 magnitude = negative ? -static_cast<unsigned __int128>(cents) : cents;
+    char digits[48];
+    char* end = digits + sizeof(digits);
+    char* begin = end;
+    for (int position = 0; magnitude > 0 || position < 3; ++position) {
+        if (position == 2) {
+            *--begin = '.';
+        }
+        *--begin = static_cast<char>('0' + static_cast<int>(magnitude % 10));
+        magnitude /= 10;
+    }
+    if (negative) {
+        *--begin = '-';
+    }
+    return std::string(begin, end);
+}
+
+using AccountId = std::uint32_t;  // Dense index of an account inside the AccountStore
+
+// TransactionType Enum: Kinds of transaction the ATM can execute
+enum class TransactionType : std::uint8_t {
+    Deposit,
+    Withdrawal,
+    Transfer,
+    Interest,  // Credited by the end-of-day interest job, not selectable at the ATM
+    Open,        // Opening balance of a newly added account, journaled only, not selectable
+    OpenDetail,  // Rest of a newly added account, journaled after its Open record only
+};
+
+// AccountKey Struct: Account number packed into one 64-bit word: the number's value in
+// the low 56 bits and its digit count in the top byte, so leading zeros survive and
+// "0123" differs from "123". Keys compare and hash as plain integers.
+struct AccountKey {
+    static constexpr std::size_t max_length = 15;  // 10^15 fits in 56 bits
+
+    std::uint64_t packed;  // Digit count << 56 | value; never 0 for a valid key
+
+    // Method to parse an account number from terminal input. Returns false unless the
+    // text is 1 to max_length decimal digits.
+    static bool from_string(std::string_view text, AccountKey& out) {
+        if (text.empty() || text.size() > max_length) {
+            return false;
+        }
+        std::uint64_t value = 0;
+        for (char c : text) {
+            unsigned digit = static_cast<unsigned char>(c) - '0';
+            if (digit > 9) {
+                return false;
+            }
+            value = value * 10 + digit;
+        }
+        out.packed = static_cast<std::uint64_t>(text.size()) << 56 | value;
+        return true;
+    }
+
+    // Method to get the number of digits
+    std::size_t length() const {
+        return static_cast<std::size_t>(packed >> 56);
+    }
+
+    // Method to convert the key back to a string, restoring leading zeros
+    std::string to_string() const {
+        std::string text(length(), '0');
+        std::uint64_t value = packed & ((std::uint64_t(1) << 56) - 1);
+        for (std::size_t i = text.size(); i-- > 0 && value > 0; value /= 10) {
+            text[i] = static_cast<char>('0' + value % 10);
+        }
+        return text;
+    }
+
+    bool operator==(const AccountKey& other) const {
+        return packed == other.packed;
+    }
+};
+
+// PinCode Struct: Fixed-width PIN so PINs can be kept in a flat array
+struct PinCode {
+    static constexpr std::size_t max_length = 7;
+
+    char digits[max_length];  // PIN characters, unused tail is zeroed
+    std::uint8_t length;      // Number of characters in use
+
+    // Method to build a PIN from terminal input. Returns false unless the text is 1 to
+    // max_length decimal digits.
+    static bool from_string(std::string_view text, PinCode& out) {
+        if (text.empty() || text.size() > max_length ||
+            !std::all_of(text.begin(), text.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            return false;
+        }
+        out = PinCode{};
+        std::memcpy(out.digits, text.data(), text.size());
+        out.length = static_cast<std::uint8_t>(text.size());
+        return true;
+    }
+};
+
+// Round constants of SHA-256
+alignas(16) constexpr std::uint32_t sha256_round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// Function to run the SHA-256 compression function over one 64-byte block
+void sha256_compress_scalar(std::uint32_t state[8], const std::uint8_t block[64]) {
+    auto rotate = [](std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    std::uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = std::uint32_t(block[4 * i]) << 24 | std::uint32_t(block[4 * i + 1]) << 16 |
+               std::uint32_t(block[4 * i + 2]) << 8 | std::uint32_t(block[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+        std::uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        std::uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        std::uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) +
+                           sha256_round_constants[i] + w[i];
+        std::uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// Function to run the SHA-256 compression function with the SHA extensions over Lanes
+// independent blocks at once. The state is kept as the ABEF/CDGH register pair the
+// instructions expect; each step runs four rounds and extends the message schedule by
+// four words. Interleaving lanes hides the latency of the round instructions, which is
+// what makes batched verification faster than one block at a time.
+template <int Lanes>
+__attribute__((target("sha,sse4.1"))) void sha256_compress_shani_lanes(std::uint32_t* const* states,
+                                                                       const std::uint8_t* const* blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i abef[Lanes], cdgh[Lanes], abef_start[Lanes], cdgh_start[Lanes], words[Lanes][4];
+    for (int l = 0; l < Lanes; ++l) {
+        __m128i low = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(states[l])), 0xb1);
+        __m128i high = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(states[l] + 4)), 0x1b);
+        abef[l] = abef_start[l] = _mm_alignr_epi8(low, high, 8);
+        cdgh[l] = cdgh_start[l] = _mm_blend_epi16(high, low, 0xf0);
+        for (int i = 0; i < 4; ++i) {
+            words[l][i] =
+                _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks[l] + 16 * i)), byte_swap);
+        }
+    }
+    for (int group = 0; group < 16; ++group) {
+        const __m128i constants =
+            _mm_load_si128(reinterpret_cast<const __m128i*>(sha256_round_constants + 4 * group));
+        for (int l = 0; l < Lanes; ++l) {
+            __m128i message = _mm_add_epi32(words[l][group & 3], constants);
+            cdgh[l] = _mm_sha256rnds2_epu32(cdgh[l], abef[l], message);
+            abef[l] = _mm_sha256rnds2_epu32(abef[l], cdgh[l], _mm_shuffle_epi32(message, 0x0e));
+            if (group < 12) {
+                __m128i next = _mm_sha256msg1_epu32(words[l][group & 3], words[l][(group + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(words[l][(group + 3) & 3], words[l][(group + 2) & 3], 4));
+                words[l][group & 3] = _mm_sha256msg2_epu32(next, words[l][(group + 3) & 3]);
+            }
+        }
+    }
+    for (int l = 0; l < Lanes; ++l) {
+        __m128i feba = _mm_shuffle_epi32(_mm_add_epi32(abef[l], abef_start[l]), 0x1b);
+        __m128i dchg = _mm_shuffle_epi32(_mm_add_epi32(cdgh[l], cdgh_start[l]), 0xb1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(states[l]), _mm_blend_epi16(feba, dchg, 0xf0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(states[l] + 4), _mm_alignr_epi8(dchg, feba, 8));
+    }
+}
+
+// Function to run the SHA-256 compression function over one block with the SHA extensions
+__attribute__((target("sha,sse4.1"))) void sha256_compress_shani(std::uint32_t state[8],
+                                                                 const std::uint8_t block[64]) {
+    sha256_compress_shani_lanes<1>(&state, &block);
+}
+
+// PinHash Struct: A PIN stored as SHA-256(salt || PIN) with a random per-account salt, so
+// the PIN itself is never kept and equal PINs do not produce equal digests. Salt and PIN
+// always fit in a single SHA-256 block, so hashing costs one compression.
+struct PinHash {
+    static constexpr std::size_t salt_size = 16;
+    static constexpr std::size_t digest_size = 32;
+
+    std::uint8_t salt[salt_size];      // Random salt
+    std::uint8_t digest[digest_size];  // SHA-256 of salt followed by the PIN characters
+
+    // Method to get the compression function for this CPU, chosen once
+    static void (*compress())(std::uint32_t*, const std::uint8_t*) {
+        static void (*const kernel)(std::uint32_t*, const std::uint8_t*) =
+            __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1") ? sha256_compress_shani
+                                                                               : sha256_compress_scalar;
+        return kernel;
+    }
+
+    // Method to get the name of the compression kernel in use
+    static const char* kernel_name() {
+        return compress() == sha256_compress_shani ? "sha-ni" : "scalar";
+    }
+
+    // Method to test whether batches can use the interleaved SHA extension kernel
+    static bool batched() {
+        return compress() == sha256_compress_shani;
+    }
+
+    // Method to lay out salt and PIN as one padded SHA-256 block
+    static void fill_block(const std::uint8_t* salt, const PinCode& pin, std::uint8_t block[64]) {
+        std::memset(block, 0, 64);
+        std::memcpy(block, salt, salt_size);
+        std::memcpy(block + salt_size, pin.digits, pin.length);
+        std::size_t length = salt_size + pin.length;
+        block[length] = 0x80;
+        block[62] = static_cast<std::uint8_t>(length * 8 >> 8);
+        block[63] = static_cast<std::uint8_t>(length * 8);
+    }
+
+    // Method to set a SHA-256 state to its initial value
+    static void start_state(std::uint32_t state[8]) {
+        static constexpr std::uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        std::memcpy(state, initial, sizeof(initial));
+    }
+
+    // Method to compare a final state with the stored digest. Every byte is compared with
+    // no early exit, so the time taken does not depend on how many leading bytes match.
+    bool equals(const std::uint32_t state[8]) const {
+        std::uint32_t difference = 0;
+        for (int i = 0; i < 8; ++i) {
+            std::uint32_t stored = std::uint32_t(digest[4 * i]) << 24 | std::uint32_t(digest[4 * i + 1]) << 16 |
+                                   std::uint32_t(digest[4 * i + 2]) << 8 | std::uint32_t(digest[4 * i + 3]);
+            difference |= stored ^ state[i];
+        }
+        return difference == 0;
+    }
+
+    // Method to fill a salt from the kernel's random pool. Every salt is drawn fresh, so
+    // no seed ties the salts of one thread or process to another's.
+    static void fill_salt(std::uint8_t* salt) {
+        std::size_t filled = 0;
+        while (filled < salt_size) {
+            ssize_t n = ::getrandom(salt + filled, salt_size - filled, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            filled += static_cast<std::size_t>(n);
+        }
+        if (filled < salt_size) {
+            std::random_device device;  // Kernel without getrandom: fall back to the device
+            for (std::size_t i = 0; i < salt_size; i += sizeof(std::uint32_t)) {
+                std::uint32_t random = device();
+                std::memcpy(salt + i, &random, sizeof(random));
+            }
+        }
+    }
+
+    // Method to build the stored form of a PIN with a fresh random salt
+    static PinHash make(const PinCode& pin) {
+        PinHash stored;
+        fill_salt(stored.salt);
+        std::uint8_t block[64];
+        std::uint32_t state[8];
+        fill_block(stored.salt, pin, block);
+        start_state(state);
+        compress()(state, block);
+        for (int i = 0; i < 8; ++i) {
+            stored.digest[4 * i] = static_cast<std::uint8_t>(state[i] >> 24);
+            stored.digest[4 * i + 1] = static_cast<std::uint8_t>(state[i] >> 16);
+            stored.digest[4 * i + 2] = static_cast<std::uint8_t>(state[i] >> 8);
+            stored.digest[4 * i + 3] = static_cast<std::uint8_t>(state[i]);
+        }
+        return stored;
+    }
+
+    // Method to check an entered PIN against the stored digest
+    bool matches(const PinCode& pin) const {
+        std::uint8_t block[64];
+        std::uint32_t state[8];
+        fill_block(salt, pin, block);
+        start_state(state);
+        compress()(state, block);
+        return equals(state);
+    }
+};
+
+// Function to write a whole buffer to a file descriptor, retrying short writes.
+// Only uses async-signal-safe calls so it can run in a forked snapshot child.
+bool write_fully(int fd, const void* data, std::size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+// Function to read a whole buffer from a file descriptor
+bool read_fully(int fd, void* data, std::size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+// Function to fsync a directory so that file creations and renames in it are durable
+bool sync_directory(const std::string& directory) {
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// SnapshotHeader Struct: Start of a ledger snapshot file. The account number, PIN and
+// balance arrays follow at the recorded 64-byte aligned offsets, then a directory with one
+// SnapshotShard entry per index shard, then each shard's slot table in turn. Everything
+// is laid out exactly as AccountStore and the index hold it in memory, so a mapped
+// snapshot can be used in place without parsing.
+struct SnapshotHeader {
+    static constexpr char expected_magic[8] = {'A', 'T', 'M', 'S', 'N', 'A', 'P', '\0'};
+    static constexpr std::uint32_t current_version = 7;
+
+    char magic[8];                  // File signature
+    std::uint32_t version;          // Layout version
+    std::uint32_t index_shards;     // Number of index shards
+    std::uint64_t accounts;         // Number of accounts in the snapshot
+    std::uint64_t first_segment;    // First journal segment that may hold records after the snapshot
+    std::uint64_t last_lsn;         // Last journal record reflected in the snapshot
+    std::uint64_t index_slots;      // Number of slots in all index shards together
+    std::uint64_t keys_offset;      // File offset of the account number array
+    std::uint64_t pins_offset;      // File offset of the PIN digest array
+    std::uint64_t balances_offset;  // File offset of the balance array
+    std::uint64_t products_offset;  // File offset of the product array
+    std::uint64_t shards_offset;    // File offset of the shard directory
+    std::uint64_t index_offset;     // File offset of the first shard's slot table
+    std::uint64_t filter_offset;    // File offset of the account number filter
+    std::uint64_t filter_blocks;    // Number of 64-byte filter blocks
+    std::uint64_t file_size;        // Total file size
+
+    // Method to fill in the signature and section offsets for a snapshot
+    void set_layout(std::uint64_t account_count, std::uint32_t shard_count, std::uint64_t slot_count,
+                    std::uint64_t filter_block_count, std::size_t key_size, std::size_t pin_size,
+                    std::size_t shard_size, std::size_t slot_size) {
+        auto align = [](std::uint64_t offset) { return (offset + 63) & ~std::uint64_t(63); };
+        std::memcpy(magic, expected_magic, sizeof(magic));
+        version = current_version;
+        index_shards = shard_count;
+        accounts = account_count;
+        index_slots = slot_count;
+        keys_offset = align(sizeof(SnapshotHeader));
+        pins_offset = align(keys_offset + accounts * key_size);
+        balances_offset = align(pins_offset + accounts * pin_size);
+        products_offset = align(balances_offset + accounts * sizeof(std::int64_t));
+        shards_offset = align(products_offset + accounts * sizeof(std::uint8_t));
+        index_offset = align(shards_offset + index_shards * shard_size);
+        filter_blocks = filter_block_count;
+        filter_offset = align(index_offset + index_slots * slot_size);
+        file_size = filter_offset + filter_blocks * 64;
+    }
+};
+
+// SnapshotShard Struct: Size of one index shard's slot table in a snapshot
+struct SnapshotShard {
+    std::uint64_t slots;    // Number of slots, a power of two or zero
+    std::uint64_t entries;  // Number of occupied slots
+};
+
+// MappedFile Class: Owns a private, writable memory mapping of a whole file. Pages are
+// read from disk on first touch and copied on first write, so the file is never changed.
+class MappedFile {
+private:
+    void* base = MAP_FAILED;  // Private member to store start of the mapping
+    std::size_t bytes = 0;    // Private member to store length of the mapping
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        reset();
+    }
+
+    // Method to map a file, replacing any previous mapping
+    bool map(const std::string& path) {
+        reset();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            bytes = static_cast<std::size_t>(st.st_size);
+            base = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            bytes = 0;
+            return false;
+        }
+        return true;
+    }
+
+    // Method to exchange mappings with another MappedFile
+    void swap(MappedFile& other) {
+        std::swap(base, other.base);
+        std::swap(bytes, other.bytes);
+    }
+
+    // Method to release the mapping
+    void reset() {
+        if (base != MAP_FAILED) {
+            ::munmap(base, bytes);
+        }
+        base = MAP_FAILED;
+        bytes = 0;
+    }
+
+    // Method to get a pointer at an offset into the mapping
+    char* at(std::uint64_t offset) const {
+        return static_cast<char*>(base) + offset;
+    }
+
+    // Method to get length of the mapping
+    std::size_t size() const {
+        return bytes;
+    }
+};
+
+// Column Class: Array of trivially copyable values split into fixed-size chunks. Values
+// never move once written, so new entries can be appended while other threads read and
+// update existing ones, and each chunk is still one contiguous run for scans. Chunks
+// can also point into memory the column does not own, such as a mapped snapshot. Owned
+// chunks come zero-filled from calloc, so entries start as zero bytes and large chunks
+// cost no page faults until they are written.
+template <typename T, std::size_t ChunkBits = 16>
+class Column {
+public:
+    static constexpr std::size_t chunk_bits = ChunkBits;
+    static constexpr std::size_t chunk_size = std::size_t(1) << chunk_bits;
+    static constexpr std::size_t max_chunks = std::size_t(1) << (32 - chunk_bits);  // Enough for every AccountId
+
+private:
+    struct Free {
+        void operator()(T* chunk) const { std::free(chunk); }
+    };
+
+    T** chunks = nullptr;                         // Private member to store the chunk directory
+    std::size_t used_chunks = 0;                  // Private member to store one past the highest directory entry set
+    std::vector<std::unique_ptr<T, Free>> owned;  // Private member to store chunks owned by the column
+
+    // Method to allocate the chunk directory on first use. It is zero-filled by calloc,
+    // so pages of it that are never used are never touched.
+    void ensure_directory() {
+        if (!chunks) {
+            chunks = static_cast<T**>(std::calloc(max_chunks, sizeof(T*)));
+            if (!chunks) {
+                throw std::bad_alloc();
+            }
+        }
+    }
+
+public:
+    static_assert(std::is_trivially_copyable<T>::value, "columns are copied and mapped as raw bytes");
+
+    Column() = default;
+    Column(const Column&) = delete;
+    Column& operator=(const Column&) = delete;
+
+    ~Column() {
+        std::free(chunks);
+    }
+
+    // Method to make sure the chunk holding entry i exists. Appends must be serialized by
+    // the caller; readers only look at entries that were published after this returned.
+    void ensure(std::size_t i) {
+        ensure_directory();
+        std::size_t c = i >> chunk_bits;
+        if (!chunks[c]) {
+            T* chunk = static_cast<T*>(std::calloc(chunk_size, sizeof(T)));
+            if (!chunk) {
+                throw std::bad_alloc();
+            }
+            owned.emplace_back(chunk);
+            chunks[c] = chunk;
+            used_chunks = std::max(used_chunks, c + 1);
+        }
+    }
+
+    // Method to make sure the first size entries exist. Entries in new chunks read as zero
+    // bytes without anything being written to them.
+    void allocate(std::size_t size) {
+        for (std::size_t i = 0; i < size; i += chunk_size) {
+            ensure(i);
+        }
+    }
+
+    // Method to use values stored elsewhere, which must outlive the column. Whole chunks
+    // point into the external array; a partly used last chunk is copied, so that later
+    // appends never write past the end of the external memory.
+    void attach(T* external, std::size_t size) {
+        clear();
+        ensure_directory();
+        std::size_t full = size >> chunk_bits;
+        for (std::size_t c = 0; c < full; ++c) {
+            chunks[c] = external + (c << chunk_bits);
+        }
+        used_chunks = std::max(used_chunks, full);
+        std::size_t tail = size & (chunk_size - 1);
+        if (tail > 0) {
+            ensure(size - 1);
+            std::memcpy(chunks[full], external + (full << chunk_bits), tail * sizeof(T));
+        }
+    }
+
+    // Method to drop all values. Only the directory entries that were set are reset, so
+    // clearing never touches the unused part of a large directory.
+    void clear() {
+        if (chunks) {
+            std::memset(chunks, 0, used_chunks * sizeof(T*));
+        }
+        used_chunks = 0;
+        owned.clear();
+    }
+
+    // Method to call f(pointer, length) for each contiguous run of the first size entries
+    template <typename F>
+    bool for_each_run(std::size_t size, F&& f) const {
+        for (std::size_t i = 0; i < size; i += chunk_size) {
+            if (!f(chunks[i >> chunk_bits], std::min(chunk_size, size - i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Method to write the first size entries to a file. Only makes write() calls, so it is
+    // safe in a forked child process.
+    bool write_to(int fd, std::size_t size) const {
+        return for_each_run(size, [fd](const T* run, std::size_t length) {
+            return write_fully(fd, run, length * sizeof(T));
+        });
+    }
+
+    T& operator[](std::size_t i) { return chunks[i >> chunk_bits][i & (chunk_size - 1)]; }
+    const T& operator[](std::size_t i) const { return chunks[i >> chunk_bits][i & (chunk_size - 1)]; }
+};
+
+// HistoryRing Struct: An account's most recent transactions in a fixed-capacity ring.
+// Appends claim a position with one atomic increment and overwrite the oldest entry, so
+// recording a transaction never allocates. Each entry carries the low bits of its
+// position plus one; readers use it to skip entries that are being overwritten.
+struct HistoryRing {
+    static constexpr std::size_t capacity = 8;
+
+    struct Entry {
+        std::uint32_t sequence;  // Position + 1 once the entry is complete
+        std::uint8_t type;       // TransactionType of the transaction
+        std::uint8_t reserved[3];
+        std::int64_t time_ns;    // Wall-clock time, nanoseconds since the Unix epoch
+        std::int64_t amount;     // Signed amount in cents, negative when money left the account
+        std::int64_t balance;    // Balance right after the transaction
+    };
+
+    Entry entries[capacity];  // Ring storage, indexed by position modulo capacity
+    std::uint64_t head;       // Number of entries ever appended
+};
+
+// StatementLine Struct: One transaction shown on a mini statement
+struct StatementLine {
+    TransactionType type;  // Kind of transaction
+    std::int64_t time_ns;  // Wall-clock time, nanoseconds since the Unix epoch
+    Money amount;          // Signed amount, negative when money left the account
+    Money balance;         // Balance right after the transaction
+};
+
+// Function to append an unsigned integer as a little-endian base-128 varint
+void append_varint(std::vector<std::uint8_t>& out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<std::uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<std::uint8_t>(value));
+}
+
+// Function to read a varint written by append_varint, advancing position past it
+std::uint64_t read_varint(const std::uint8_t* data, std::size_t& position) {
+    std::uint64_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        std::uint8_t byte = data[position++];
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return value;
+        }
+    }
+}
+
+// Function to map a signed integer to an unsigned one so small magnitudes stay small
+std::uint64_t zigzag_encode(std::int64_t value) {
+    return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+}
+
+// Function to undo zigzag_encode
+std::int64_t zigzag_decode(std::uint64_t value) {
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+}
+
+// Statement Struct: An account's transactions over a time range
+struct Statement {
+    Money opening;                    // Balance at the start of the range
+    Money closing;                    // Balance at the end of the range
+    std::vector<StatementLine> lines; // Transactions in the range, oldest first
+    std::size_t blocks_read = 0;      // History blocks decoded to build the statement
+};
+
+// HistoryExtent Struct: Entry of the history index file, describing a run of one
+// account's transactions stored in the history data file: either a whole block, or the
+// part of a still-filling block written at a checkpoint. The run's three columns lie one
+// after the other at offset in the data file.
+struct HistoryExtent {
+    std::uint64_t offset;         // Position of the run's columns in the data file
+    std::int64_t base_us;         // Time the first time delta counts from
+    std::int64_t last_us;         // Time of the last transaction
+    std::int64_t opening;         // Balance before the first transaction, in cents
+    std::int64_t closing;         // Balance after the last transaction, in cents
+    AccountId account;            // Account the transactions belong to
+    std::uint32_t block;          // Position of the block in the account's history
+    std::uint16_t start;          // Position of the run's first transaction in the block
+    std::uint16_t count;          // Number of transactions in the run
+    std::uint32_t times_bytes;    // Length of the time column
+    std::uint32_t amounts_bytes;  // Length of the amount column
+    std::uint32_t reserved;
+};
+static_assert(sizeof(HistoryExtent) == 64, "HistoryExtent is an on-disk format");
+
+// HistoryState Struct: Contents of the history state file, replaced atomically each time
+// the history is persisted. Anything in the data and index files past these lengths was
+// written after that and is discarded on load; the journal still holds those records.
+struct HistoryState {
+    std::uint64_t lsn;            // Every journal record up to here is in the files
+    std::uint64_t data_bytes;     // Valid length of the data file
+    std::uint64_t index_entries;  // Valid entries in the index file
+};
+
+// HistoryStore Class: Full transaction history of every account, kept append-only and
+// compressed. Each account's history is a list of blocks of up to block_capacity
+// transactions, stored column by column: types packed four to a byte, timestamps as
+// varint deltas in microseconds and amounts as zigzag varints in cents. Each block also
+// records its time range and the balance before and after it, and those headers form the
+// account's block index, so a statement binary searches the index and decodes only the
+// blocks that overlap the requested range. Only the index and each account's filling
+// block stay in memory: a block is written to the data file as soon as it is full, and
+// persist() writes the rest at checkpoints. Accounts are spread over shards by id, each
+// with its own mutex, so statements rarely wait for the thread appending.
+class HistoryStore {
+public:
+    static constexpr std::size_t block_capacity = 256;
+    static constexpr std::size_t shard_bits = 6;
+
+private:
+    // Block Struct: Header of up to block_capacity transactions of one account
+    struct Block {
+        std::int64_t first_us = 0;         // Time of the first transaction
+        std::int64_t last_us = 0;          // Time of the last transaction
+        std::int64_t opening = 0;          // Balance before the first transaction, in cents
+        std::int64_t closing = 0;          // Balance after the last transaction, in cents
+        std::uint64_t offset = 0;          // Position of the columns in the data file once full
+        std::uint32_t count = 0;           // Number of transactions
+        std::uint32_t times_bytes = 0;     // Length of the time column in the data file
+        std::uint32_t amounts_bytes = 0;   // Length of the amount column in the data file
+    };
+
+    // OpenBlock Struct: Columns of an account's last block while it is still filling
+    struct OpenBlock {
+        std::vector<std::uint8_t> types;    // Two bits per transaction
+        std::vector<std::uint8_t> times;    // Varint delta from the previous transaction
+        std::vector<std::uint8_t> amounts;  // Zigzag varint signed amount
+        std::uint32_t written = 0;          // Transactions already in the files
+        std::size_t written_times = 0;      // Bytes of the time column they cover
+        std::size_t written_amounts = 0;    // Bytes of the amount column they cover
+        std::int64_t written_us = 0;        // Time of the last transaction written
+        std::int64_t written_balance = 0;   // Balance after it
+    };
+
+    // AccountHistory Struct: Block index of one account
+    struct AccountHistory {
+        std::vector<Block> blocks;        // Every block, oldest first
+        std::unique_ptr<OpenBlock> open;  // Columns of the last block while it is not full
+    };
+
+    // Shard Struct: Histories of the accounts whose low id bits select this shard
+    struct Shard {
+        std::mutex mutex;                      // Guards accounts
+        std::vector<AccountHistory> accounts;  // Histories indexed by id >> shard_bits
+    };
+
+    std::unique_ptr<Shard[]> shards{new Shard[std::size_t(1) << shard_bits]};  // Private member to store shards
+    std::string directory;            // Private member to store the directory holding the files
+    int data_fd = -1;                 // Private member to store the open data file
+    int index_fd = -1;                // Private member to store the open index file
+    std::uint64_t data_bytes = 0;     // Private member to store the length of the data file
+    std::uint64_t index_entries = 0;  // Private member to store the number of index entries
+    std::uint64_t persisted_lsn = 0;  // Private member to store the journal position the files cover
+
+    // Method to get the shard of an account
+    Shard& shard_of(AccountId id) const {
+        return shards[id & ((std::size_t(1) << shard_bits) - 1)];
+    }
+
+    // Method to get the history of an account, creating an empty one if needed
+    static AccountHistory& slot(Shard& shard, AccountId id) {
+        std::size_t local = id >> shard_bits;
+        if (local >= shard.accounts.size()) {
+            shard.accounts.resize(local + 1);
+        }
+        return shard.accounts[local];
+    }
+
+    // Method to call f(type, time_us, amount) for count transactions decoded from a run's
+    // columns, stopping early when f returns false
+    template <typename F>
+    static void decode(const std::uint8_t* types, const std::uint8_t* times, const std::uint8_t* amounts,
+                       std::uint32_t count, std::int64_t base_us, F&& f) {
+        std::int64_t time_us = base_us;
+        std::size_t time_position = 0;
+        std::size_t amount_position = 0;
+        for (std::uint32_t i = 0; i < count; ++i) {
+            time_us += static_cast<std::int64_t>(read_varint(times, time_position));
+            std::int64_t amount = zigzag_decode(read_varint(amounts, amount_position));
+            auto type = static_cast<TransactionType>((types[i / 4] >> (i % 4 * 2)) & 3);
+            if (!f(type, time_us, amount)) {
+                return;
+            }
+        }
+    }
+
+    // Method to append a run's columns to the data file and its entry to the index file.
+    // I/O errors abort, as in the journal, since history would otherwise be lost silently.
+    void write_extent(HistoryExtent& extent, const std::uint8_t* types, const std::uint8_t* times,
+                      const std::uint8_t* amounts) {
+        std::size_t type_bytes = (extent.count + 3) / 4;
+        std::size_t bytes = type_bytes + extent.times_bytes + extent.amounts_bytes;
+        struct iovec parts[3] = {{const_cast<std::uint8_t*>(types), type_bytes},
+                                 {const_cast<std::uint8_t*>(times), extent.times_bytes},
+                                 {const_cast<std::uint8_t*>(amounts), extent.amounts_bytes}};
+        extent.offset = data_bytes;
+        if (::pwritev(data_fd, parts, 3, static_cast<off_t>(data_bytes)) != static_cast<ssize_t>(bytes) ||
+            ::pwrite(index_fd, &extent, sizeof(extent), static_cast<off_t>(index_entries * sizeof(extent))) !=
+                static_cast<ssize_t>(sizeof(extent))) {
+            std::perror("history write");
+            std::abort();
+        }
+        data_bytes += bytes;
+        ++index_entries;
+    }
+
+    // Method to note that all of a filling block is now in the files
+    static void mark_written(OpenBlock& open, const Block& block) {
+        open.written = block.count;
+        open.written_times = open.times.size();
+        open.written_amounts = open.amounts.size();
+        open.written_us = block.last_us;
+        open.written_balance = block.closing;
+    }
+
+    // Method to append a transaction to an account's history. Timestamps are kept
+    // non-decreasing per account so deltas stay small and blocks stay ordered by time. A
+    // block that becomes full is written to the files and its columns are released.
+    void append(AccountHistory& history, AccountId id, TransactionType type, std::int64_t time_us,
+                std::int64_t amount, std::int64_t balance_after) {
+        std::vector<Block>& blocks = history.blocks;
+        std::int64_t previous_us = time_us;
+        std::int64_t balance = balance_after - amount;
+        if (!blocks.empty()) {
+            previous_us = blocks.back().last_us;
+            time_us = std::max(time_us, previous_us);
+            balance = blocks.back().closing;  // Keep the running balance consistent with the amounts
+        }
+        if (!history.open) {
+            Block block;
+            block.first_us = time_us;
+            block.last_us = time_us;
+            block.opening = balance;
+            block.closing = balance;
+            blocks.push_back(block);
+            history.open = std::make_unique<OpenBlock>();
+            history.open->types.reserve(block_capacity / 4);
+            history.open->written_us = time_us;
+            history.open->written_balance = balance;
+            previous_us = time_us;
+        }
+        Block& block = blocks.back();
+        OpenBlock& open = *history.open;
+        if (block.count % 4 == 0) {
+            open.types.push_back(0);
+        }
+        open.types.back() |= static_cast<std::uint8_t>(static_cast<std::uint8_t>(type) << (block.count % 4 * 2));
+        append_varint(open.times, static_cast<std::uint64_t>(time_us - previous_us));
+        append_varint(open.amounts, zigzag_encode(amount));
+        block.last_us = time_us;
+        block.closing += amount;
+        if (++block.count == block_capacity) {
+            HistoryExtent extent{};
+            extent.base_us = block.first_us;
+            extent.last_us = block.last_us;
+            extent.opening = block.opening;
+            extent.closing = block.closing;
+            extent.account = id;
+            extent.block = static_cast<std::uint32_t>(blocks.size() - 1);
+            extent.count = static_cast<std::uint16_t>(block.count);
+            extent.times_bytes = static_cast<std::uint32_t>(open.times.size());
+            extent.amounts_bytes = static_cast<std::uint32_t>(open.amounts.size());
+            write_extent(extent, open.types.data(), open.times.data(), open.amounts.data());
+            block.offset = extent.offset;
+            block.times_bytes = extent.times_bytes;
+            block.amounts_bytes = extent.amounts_bytes;
+            history.open.reset();
+        }
+    }
+
+    // Method to add one index entry to the block index while loading. A whole block
+    // becomes a header pointing into the data file; a run of a block that was still
+    // filling is decoded back into that block's columns. Runs a later whole block
+    // supersedes, and entries pointing past the data file, are skipped.
+    void load_extent(const HistoryExtent& extent, const std::uint8_t* data) {
+        std::uint64_t bytes = (extent.count + 3) / 4 + std::uint64_t(extent.times_bytes) + extent.amounts_bytes;
+        if (extent.count == 0 || extent.offset > data_bytes || bytes > data_bytes - extent.offset) {
+            return;
+        }
+        AccountHistory& history = slot(shard_of(extent.account), extent.account);
+        std::vector<Block>& blocks = history.blocks;
+        bool filling = history.open && extent.block + std::size_t(1) == blocks.size();
+        if (extent.start == 0 && extent.count == block_capacity) {
+            if (!filling && extent.block != blocks.size()) {
+                return;
+            }
+            if (!filling) {
+                blocks.emplace_back();
+            }
+            Block& block = blocks.back();
+            block.first_us = extent.base_us;
+            block.last_us = extent.last_us;
+            block.opening = extent.opening;
+            block.closing = extent.closing;
+            block.offset = extent.offset;
+            block.count = extent.count;
+            block.times_bytes = extent.times_bytes;
+            block.amounts_bytes = extent.amounts_bytes;
+            history.open.reset();
+            return;
+        }
+        bool continues = filling && extent.start == blocks.back().count;
+        bool starts = !history.open && extent.block == blocks.size() && extent.start == 0;
+        if (!continues && !starts) {
+            return;
+        }
+        const std::uint8_t* types = data + extent.offset;
+        const std::uint8_t* times = types + (extent.count + 3) / 4;
+        std::int64_t balance = extent.opening;
+        decode(types, times, times + extent.times_bytes, extent.count, extent.base_us,
+               [&](TransactionType type, std::int64_t time_us, std::int64_t amount) {
+                   balance += amount;
+                   append(history, extent.account, type, time_us, amount, balance);
+                   return true;
+               });
+        if (history.open) {
+            mark_written(*history.open, blocks.back());
+        }
+    }
+
+    // Method to get the path of one of the history files
+    std::string path(const char* name) const {
+        return directory + "/" + name;
+    }
+
+public:
+    HistoryStore() = default;
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    ~HistoryStore() {
+        close();
+    }
+
+    // Method to open the history files in a directory, creating them if needed, and load
+    // the block index from them in place of whatever was in memory. Returns false if the
+    // files cannot be opened or are shorter than the state file says.
+    bool open(const std::string& history_directory) {
+        close();
+        for (std::size_t s = 0; s < (std::size_t(1) << shard_bits); ++s) {
+            std::lock_guard<std::mutex> lock(shards[s].mutex);
+            shards[s].accounts.clear();
+        }
+        directory = history_directory;
+        HistoryState state{};
+        int state_fd = ::open(path("history.state").c_str(), O_RDONLY | O_CLOEXEC);
+        if (state_fd >= 0) {
+            if (!read_fully(state_fd, &state, sizeof(state))) {
+                state = HistoryState{};
+            }
+            ::close(state_fd);
+        }
+        data_fd = ::open(path("history.dat").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        index_fd = ::open(path("history.idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat data_stat;
+        struct stat index_stat;
+        if (data_fd < 0 || index_fd < 0 || ::fstat(data_fd, &data_stat) != 0 || ::fstat(index_fd, &index_stat) != 0 ||
+            static_cast<std::uint64_t>(data_stat.st_size) < state.data_bytes ||
+            static_cast<std::uint64_t>(index_stat.st_size) < state.index_entries * sizeof(HistoryExtent) ||
+            ::ftruncate(data_fd, static_cast<off_t>(state.data_bytes)) != 0 ||
+            ::ftruncate(index_fd, static_cast<off_t>(state.index_entries * sizeof(HistoryExtent))) != 0) {
+            close();
+            return false;
+        }
+        data_bytes = state.data_bytes;
+        index_entries = state.index_entries;
+        persisted_lsn = state.lsn;
+
+        std::vector<HistoryExtent> extents(index_entries);
+        MappedFile data;
+        if (index_entries > 0 &&
+            (::pread(index_fd, extents.data(), extents.size() * sizeof(HistoryExtent), 0) !=
+                 static_cast<ssize_t>(extents.size() * sizeof(HistoryExtent)) ||
+             !data.map(path("history.dat")))) {
+            close();
+            return false;
+        }
+        for (const HistoryExtent& extent : extents) {
+            load_extent(extent, reinterpret_cast<const std::uint8_t*>(data.at(0)));
+        }
+        return true;
+    }
+
+    // Method to close the history files
+    void close() {
+        if (data_fd >= 0) {
+            ::close(data_fd);
+        }
+        if (index_fd >= 0) {
+            ::close(index_fd);
+        }
+        data_fd = -1;
+        index_fd = -1;
+    }
+
+    // Method to test whether the history files are open
+    bool is_open() const {
+        return data_fd >= 0;
+    }
+
+    // Method to get the last journal record covered by the files as of the last persist
+    std::uint64_t persisted() const {
+        return persisted_lsn;
+    }
+
+    // Method to append a transaction to an account's history. Appends come from a single
+    // thread, in the order the transactions happened.
+    void append(AccountId id, TransactionType type, std::int64_t time_us, std::int64_t amount,
+                std::int64_t balance_after) {
+        Shard& shard = shard_of(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        append(slot(shard, id), id, type, time_us, amount, balance_after);
+    }
+
+    // Method to make everything appended so far durable: the unwritten part of every
+    // filling block is written as one more run, both files are synced, and the state file
+    // is replaced to cover them. lsn is the last journal record appended; must not run
+    // while append() does.
+    bool persist(std::uint64_t lsn) {
+        std::vector<std::uint8_t> types;
+        for (std::size_t s = 0; s < (std::size_t(1) << shard_bits); ++s) {
+            Shard& shard = shards[s];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (std::size_t local = 0; local < shard.accounts.size(); ++local) {
+                AccountHistory& history = shard.accounts[local];
+                if (!history.open || history.open->written == history.blocks.back().count) {
+                    continue;
+                }
+                OpenBlock& open = *history.open;
+                const Block& block = history.blocks.back();
+                HistoryExtent extent{};
+                extent.base_us = open.written_us;
+                extent.last_us = block.last_us;
+                extent.opening = open.written_balance;
+                extent.closing = block.closing;
+                extent.account = static_cast<AccountId>(local << shard_bits | s);
+                extent.block = static_cast<std::uint32_t>(history.blocks.size() - 1);
+                extent.start = static_cast<std::uint16_t>(open.written);
+                extent.count = static_cast<std::uint16_t>(block.count - open.written);
+                extent.times_bytes = static_cast<std::uint32_t>(open.times.size() - open.written_times);
+                extent.amounts_bytes = static_cast<std::uint32_t>(open.amounts.size() - open.written_amounts);
+                // Repack the run's types so they start at the beginning of a byte
+                types.assign((extent.count + 3) / 4, 0);
+                for (std::uint32_t i = 0; i < extent.count; ++i) {
+                    std::uint32_t from = open.written + i;
+                    types[i / 4] |= static_cast<std::uint8_t>(((open.types[from / 4] >> (from % 4 * 2)) & 3) << (i % 4 * 2));
+                }
+                write_extent(extent, types.data(), open.times.data() + open.written_times,
+                             open.amounts.data() + open.written_amounts);
+                mark_written(open, block);
+            }
+        }
+        HistoryState state{lsn, data_bytes, index_entries};
+        std::string temporary = path("history.tmp");
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = ::fdatasync(data_fd) == 0 && ::fdatasync(index_fd) == 0 && fd >= 0 &&
+                  write_fully(fd, &state, sizeof(state)) && ::fsync(fd) == 0;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        ok = ok && ::rename(temporary.c_str(), path("history.state").c_str()) == 0 && sync_directory(directory);
+        if (ok) {
+            persisted_lsn = lsn;
+        }
+        return ok;
+    }
+
+    // Method to build a statement of the transactions with from_us <= time < to_us. Full
+    // blocks are read back from the data file. Returns false if the account has no
+    // history or it cannot be read, leaving the statement empty.
+    bool statement(AccountId id, std::int64_t from_us, std::int64_t to_us, Statement& result) const {
+        Shard& shard = shard_of(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        result.lines.clear();
+        result.blocks_read = 0;
+        std::size_t local = id >> shard_bits;
+        if (local >= shard.accounts.size() || shard.accounts[local].blocks.empty()) {
+            return false;
+        }
+        const AccountHistory& history = shard.accounts[local];
+        const std::vector<Block>& blocks = history.blocks;
+        auto block = std::partition_point(blocks.begin(), blocks.end(),
+                                          [&](const Block& b) { return b.last_us < from_us; });
+        std::int64_t balance = block != blocks.end() ? block->opening : blocks.back().closing;
+        result.opening = Money::from_cents(balance);
+        std::vector<std::uint8_t> buffer;
+        for (; block != blocks.end() && block->first_us < to_us; ++block) {
+            ++result.blocks_read;
+            const std::uint8_t* types;
+            const std::uint8_t* times;
+            const std::uint8_t* amounts;
+            if (history.open && &*block == &blocks.back()) {
+                types = history.open->types.data();
+                times = history.open->times.data();
+                amounts = history.open->amounts.data();
+            } else {
+                std::size_t type_bytes = (block->count + 3) / 4;
+                buffer.resize(type_bytes + block->times_bytes + block->amounts_bytes);
+                if (::pread(data_fd, buffer.data(), buffer.size(), static_cast<off_t>(block->offset)) !=
+                    static_cast<ssize_t>(buffer.size())) {
+                    result.lines.clear();
+                    return false;
+                }
+                types = buffer.data();
+                times = types + type_bytes;
+                amounts = times + block->times_bytes;
+            }
+            decode(types, times, amounts, block->count, block->first_us,
+                   [&](TransactionType type, std::int64_t time_us, std::int64_t amount) {
+                       if (time_us >= to_us) {
+                           return false;
+                       }
+                       balance += amount;
+                       if (time_us < from_us) {
+                           result.opening = Money::from_cents(balance);
+                       } else {
+                           result.lines.push_back(StatementLine{type, time_us * 1000, Money::from_cents(amount),
+                                                                Money::from_cents(balance)});
+                       }
+                       return true;
+                   });
+        }
+        result.closing = Money::from_cents(balance);
+        return true;
+    }
+
+    // Method to get the number of bytes of memory used by block headers and filling blocks
+    std::size_t memory_usage() const {
+        std::size_t bytes = 0;
+        for (std::size_t s = 0; s < (std::size_t(1) << shard_bits); ++s) {
+            std::lock_guard<std::mutex> lock(shards[s].mutex);
+            for (const AccountHistory& history : shards[s].accounts) {
+                bytes += history.blocks.capacity() * sizeof(Block);
+                if (history.open) {
+                    bytes += sizeof(OpenBlock) + history.open->types.capacity() + history.open->times.capacity() +
+                             history.open->amounts.capacity();
+                }
+            }
+        }
+        return bytes;
+    }
+};
+
+// FailureWindow Struct: Failed-PIN count of an account or terminal in one time window,
+// packed into a single 64-bit word as window << 16 | count so it can be read and
+// updated with plain atomic operations. A word from an earlier window counts as zero,
+// so counters never need to be reset by a background job.
+struct FailureWindow {
+    static constexpr std::uint64_t count_mask = 0xffff;
+
+    // Method to get the number of the window a point in time falls into. Windows are
+    // numbered from 1 so that a zero word always means no failures.
+    static std::uint64_t current(std::chrono::seconds window_length) {
+        auto now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch());
+        return static_cast<std::uint64_t>(now / window_length) + 1;
+    }
+
+    // Method to get the failures a word holds for a window
+    static std::uint32_t failures(std::uint64_t word, std::uint64_t window) {
+        return (word >> 16) == window ? static_cast<std::uint32_t>(word & count_mask) : 0;
+    }
+
+    // Method to count an attempt as a failure before it is checked, unless the window
+    // already holds limit failures. Checking and counting are one CAS, so however many
+    // attempts race, at most limit of them get through in a window. Returns the word
+    // written, or 0 if the attempt is refused.
+    static std::uint64_t reserve(std::atomic_ref<std::uint64_t> word, std::uint64_t window, std::uint32_t limit) {
+        std::uint64_t current_word = word.load(std::memory_order_relaxed);
+        std::uint64_t next;
+        do {
+            std::uint32_t count = failures(current_word, window);
+            if (count >= limit || count >= count_mask) {
+                return 0;
+            }
+            next = window << 16 | (count + 1);
+        } while (!word.compare_exchange_weak(current_word, next, std::memory_order_relaxed));
+        return next;
+    }
+
+    // Method to take back a reserved failure once the attempt has succeeded. With clear
+    // set, and nothing else counted since the reservation, every failure in the window is
+    // cleared. Otherwise only this attempt's failure is removed, so failures counted
+    // concurrently by other attempts are kept.
+    static void release(std::atomic_ref<std::uint64_t> word, std::uint64_t reserved, bool clear) {
+        std::uint64_t current_word = reserved;
+        if (clear && word.compare_exchange_strong(current_word, 0, std::memory_order_relaxed)) {
+            return;
+        }
+        std::uint64_t window = reserved >> 16;
+        current_word = word.load(std::memory_order_relaxed);
+        while (failures(current_word, window) > 0 &&
+               !word.compare_exchange_weak(current_word, current_word - 1, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+// AccountStore Class: Keeps every account field in its own array (structure of arrays)
+// addressed by a dense AccountId. Balance-only work such as end-of-day totals then reads
+// packed runs of 8-byte balances instead of hopping between objects. Balances are
+// updated atomically, so deposits, withdrawals and balance checks may run from many
+// terminal threads at once, and accounts may be added at the same time because the
+// arrays never move.
+class AccountStore {
+private:
+    Column<AccountKey> keys;        // Private member to store account numbers
+    Column<PinHash> pins;           // Private member to store salted PIN digests
+    Column<std::int64_t> balances;  // Private member to store balances in cents
+    Column<std::uint8_t> products;  // Private member to store the product each account belongs to
+    Column<std::uint32_t> versions; // Private member to store per-account seqlock versions, odd while a transfer runs
+    Column<std::uint64_t> pin_failures;  // Private member to store failed PIN attempts per account as FailureWindow words
+    Column<HistoryRing, 10> history;  // Private member to store recent transactions per account
+    std::atomic<std::size_t> count{0};  // Private member to store number of accounts
+    std::mutex append_mutex;        // Private member to serialize appends
+
+    // Method to get atomic access to a balance
+    std::atomic_ref<std::int64_t> balance_ref(AccountId id) const {
+        return std::atomic_ref<std::int64_t>(const_cast<std::int64_t&>(balances[id]));
+    }
+
+    // Method to get atomic access to an account's version
+    std::atomic_ref<std::uint32_t> version_ref(AccountId id) const {
+        return std::atomic_ref<std::uint32_t>(const_cast<std::uint32_t&>(versions[id]));
+    }
+
+    // Method to take an account's transfer lock with a single attempt. The version word
+    // doubles as the lock: taking it makes the version odd.
+    bool try_lock(AccountId id) {
+        std::atomic_ref<std::uint32_t> version = version_ref(id);
+        std::uint32_t current = version.load(std::memory_order_relaxed);
+        return (current & 1) == 0 &&
+               version.compare_exchange_strong(current, current + 1, std::memory_order_acquire,
+                                               std::memory_order_relaxed);
+    }
+
+    // Method to take an account's transfer lock, spinning and then yielding while it is held
+    void lock(AccountId id) {
+        for (unsigned spins = 0; !try_lock(id); ++spins) {
+            if (spins >= 64) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Method to release an account's transfer lock, making the version even again
+    void unlock(AccountId id) {
+        version_ref(id).fetch_add(1, std::memory_order_release);
+    }
+
+public:
+    // Method to append an account and return its id. Appends are serialized by a short
+    // critical section; the new id becomes visible through size() once it is complete.
+    AccountId add(const AccountKey& key, const PinCode& pin, Money balance) {
+        return add(key, PinHash::make(pin), balance);
+    }
+
+    // Method to append an account whose PIN is already hashed, such as one recreated from
+    // the journal, and return its id
+    AccountId add(const AccountKey& key, const PinHash& pin, Money balance) {
+        std::lock_guard<std::mutex> lock(append_mutex);
+        std::size_t id = count.load(std::memory_order_relaxed);
+        keys.ensure(id);
+        pins.ensure(id);
+        balances.ensure(id);
+        versions.ensure(id);
+        keys[id] = key;
+        pins[id] = pin;
+        balances[id] = balance.to_cents();
+        products.ensure(id);
+        products[id] = 0;
+        versions[id] = 0;
+        pin_failures.ensure(id);
+        pin_failures[id] = 0;
+        history.ensure(id);  // New entries are zero, an empty ring
+        count.store(id + 1, std::memory_order_release);
+        return static_cast<AccountId>(id);
+    }
+
+    // Method to use account arrays stored elsewhere, such as in a mapped snapshot
+    void attach(AccountKey* key_data, PinHash* pin_data, std::int64_t* balance_data, std::uint8_t* product_data,
+                std::size_t size) {
+        std::lock_guard<std::mutex> lock(append_mutex);
+        keys.attach(key_data, size);
+        pins.attach(pin_data, size);
+        balances.attach(balance_data, size);
+        products.attach(product_data, size);
+        versions.clear();
+        versions.allocate(size);
+        pin_failures.clear();
+        pin_failures.allocate(size);
+        history.clear();
+        history.allocate(size);
+        count.store(size, std::memory_order_release);
+    }
+
+    // Method to take the append lock, so that no account is added while it is held
+    std::unique_lock<std::mutex> lock_appends() {
+        return std::unique_lock<std::mutex>(append_mutex);
+    }
+
+    // Method to get number of accounts in the store
+    std::size_t size() const {
+        return count.load(std::memory_order_acquire);
+    }
+
+    // Method to get the account number of an account
+    const AccountKey& key(AccountId id) const {
+        return keys[id];
+    }
+
+    // Method to write the account number, PIN, balance or product array of the first size
+    // accounts to a file. Only makes write() calls, so it is safe in a forked child process.
+    bool write_keys(int fd, std::size_t size) const {
+        return keys.write_to(fd, size);
+    }
+    bool write_pins(int fd, std::size_t size) const {
+        return pins.write_to(fd, size);
+    }
+    bool write_balances(int fd, std::size_t size) const {
+        return balances.write_to(fd, size);
+    }
+    bool write_products(int fd, std::size_t size) const {
+        return products.write_to(fd, size);
+    }
+
+    // Method to copy the balances and products of the first size accounts into flat arrays
+    void copy_balances(std::int64_t* balance_out, std::uint8_t* product_out, std::size_t size) const {
+        balances.for_each_run(size, [&balance_out](const std::int64_t* run, std::size_t length) {
+            std::memcpy(balance_out, run, length * sizeof(std::int64_t));
+            balance_out += length;
+            return true;
+        });
+        products.for_each_run(size, [&product_out](const std::uint8_t* run, std::size_t length) {
+            std::memcpy(product_out, run, length);
+            product_out += length;
+            return true;
+        });
+    }
+
+    // Method to call f(first_id, run, length) for each contiguous run of the first size
+    // balances; each run is one chunk of the balance column
+    template <typename F>
+    void for_each_balance_run(std::size_t size, F&& f) const {
+        std::size_t first = 0;
+        balances.for_each_run(size, [&](const std::int64_t* run, std::size_t length) {
+            f(static_cast<AccountId>(first), run, length);
+            first += length;
+            return true;
+        });
+    }
+
+    // Method to get the product an account belongs to
+    std::uint8_t product(AccountId id) const {
+        return std::atomic_ref<std::uint8_t>(const_cast<std::uint8_t&>(products[id])).load(std::memory_order_relaxed);
+    }
+
+    // Method to move an account to another product
+    void set_product(AccountId id, std::uint8_t product) {
+        std::atomic_ref<std::uint8_t>(products[id]).store(product, std::memory_order_relaxed);
+    }
+
+    // Method to check balance. Reads follow the seqlock protocol: they never write to the
+    // account, so any number of readers share its cache line without bouncing it, and a
+    // read that overlaps a transfer is retried so it never sees a half-finished transfer
+    // (such as a debit about to be refunded).
+    Money balance(AccountId id) const {
+        std::atomic_ref<std::uint32_t> version = version_ref(id);
+        for (unsigned spins = 0;; ++spins) {
+            std::uint32_t before = version.load(std::memory_order_acquire);
+            if ((before & 1) == 0) {
+                std::int64_t cents = balance_ref(id).load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (version.load(std::memory_order_relaxed) == before) {
+                    return Money::from_cents(cents);
+                }
+            }
+            if (spins >= 64) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    // Method to add amount to a balance with a CAS loop, refusing to overflow; sets
+    // balance_after to the new balance
+    bool credit(AccountId id, Money amount, std::int64_t& balance_after) {
+        if (amount <= Money()) {
+            return false;
+        }
+        std::atomic_ref<std::int64_t> balance = balance_ref(id);
+        std::int64_t current = balance.load(std::memory_order_relaxed);
+        do {
+            if (amount > Money::max() - Money::from_cents(current)) {
+                return false;
+            }
+        } while (!balance.compare_exchange_weak(current, current + amount.to_cents(), std::memory_order_acq_rel,
+                                                std::memory_order_relaxed));
+        balance_after = current + amount.to_cents();
+        return true;
+    }
+
+    // Method to take amount from a balance with a CAS loop. It only commits if the balance
+    // read still covers the amount, so concurrent withdrawals can never overdraw the
+    // account; sets balance_after to the new balance
+    bool debit(AccountId id, Money amount, std::int64_t& balance_after) {
+        if (amount <= Money()) {
+            return false;
+        }
+        std::atomic_ref<std::int64_t> balance = balance_ref(id);
+        std::int64_t current = balance.load(std::memory_order_relaxed);
+        do {
+            if (amount > Money::from_cents(current)) {
+                return false;
+            }
+        } while (!balance.compare_exchange_weak(current, current - amount.to_cents(), std::memory_order_acq_rel,
+                                                std::memory_order_relaxed));
+        balance_after = current - amount.to_cents();
+        return true;
+    }
+
+    // Method to append a transaction to an account's history ring, one atomic increment
+    // and four plain-sized stores
+    void record(AccountId id, TransactionType type, std::int64_t amount, std::int64_t balance_after) {
+        HistoryRing& ring = history[id];
+        std::uint64_t position = std::atomic_ref<std::uint64_t>(ring.head).fetch_add(1, std::memory_order_relaxed);
+        HistoryRing::Entry& entry = ring.entries[position % HistoryRing::capacity];
+        std::atomic_ref<std::uint32_t> sequence(entry.sequence);
+        sequence.store(0, std::memory_order_relaxed);  // Mark the entry as being written
+        std::atomic_thread_fence(std::memory_order_release);
+        std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::system_clock::now().time_since_epoch()).count();
+        std::atomic_ref<std::uint8_t>(entry.type).store(static_cast<std::uint8_t>(type), std::memory_order_relaxed);
+        std::atomic_ref<std::int64_t>(entry.time_ns).store(now, std::memory_order_relaxed);
+        std::atomic_ref<std::int64_t>(entry.amount).store(amount, std::memory_order_relaxed);
+        std::atomic_ref<std::int64_t>(entry.balance).store(balance_after, std::memory_order_relaxed);
+        sequence.store(static_cast<std::uint32_t>(position + 1), std::memory_order_release);
+    }
+
+public:
+    // Method to deposit amount
+    bool deposit(AccountId id, Money amount) {
+        std::int64_t balance_after;
+        if (!credit(id, amount, balance_after)) {
+            return false;
+        }
+        record(id, TransactionType::Deposit, amount.to_cents(), balance_after);
+        return true;
+    }
+
+    // Method to withdraw amount
+    bool withdraw(AccountId id, Money amount) {
+        std::int64_t balance_after;
+        if (!debit(id, amount, balance_after)) {
+            return false;
+        }
+        record(id, TransactionType::Withdrawal, -amount.to_cents(), balance_after);
+        return true;
+    }
+
+    // Method to move an amount between two accounts as one step. Both accounts are locked
+    // in account id order, so two transfers in opposite directions cannot deadlock. The
+    // usual uncontended case takes each lock with a single exchange; only if one is held
+    // does the transfer fall back to waiting for the locks in order. Deposits and
+    // withdrawals do not take these locks, so the debit and credit still use the CAS
+    // loops that keep the balance rules for concurrent updates.
+    bool transfer(AccountId from, AccountId to, Money amount) {
+        if (from == to || amount <= Money()) {
+            return false;
+        }
+        AccountId first = std::min(from, to);
+        AccountId second = std::max(from, to);
+        if (!try_lock(first)) {
+            lock(first);
+            lock(second);
+        } else if (!try_lock(second)) {
+            lock(second);
+        }
+        std::int64_t from_after;
+        std::int64_t to_after;
+        bool success = debit(from, amount, from_after);
+        if (success && !credit(to, amount, to_after)) {
+            credit(from, amount, from_after);  // Credit would overflow the destination, give the money back
+            success = false;
+        }
+        if (success) {
+            record(from, TransactionType::Transfer, -amount.to_cents(), from_after);
+            record(to, TransactionType::Transfer, amount.to_cents(), to_after);
+        }
+        unlock(second);
+        unlock(first);
+        return success;
+    }
+
+    // Method to credit interest, recorded in the history like any other transaction
+    bool accrue(AccountId id, Money amount) {
+        std::int64_t balance_after;
+        if (!credit(id, amount, balance_after)) {
+            return false;
+        }
+        record(id, TransactionType::Interest, amount.to_cents(), balance_after);
+        return true;
+    }
+
+    // Method to copy an account's most recent transactions, newest first, into lines;
+    // returns how many were copied. Entries being overwritten at that moment are skipped.
+    std::size_t recent_transactions(AccountId id, StatementLine* lines, std::size_t max_lines) const {
+        const HistoryRing& ring = history[id];
+        std::uint64_t head =
+            std::atomic_ref<std::uint64_t>(const_cast<std::uint64_t&>(ring.head)).load(std::memory_order_acquire);
+        std::size_t copied = 0;
+        for (std::uint64_t back = 1; back <= std::min<std::uint64_t>(head, HistoryRing::capacity) && copied < max_lines;
+             ++back) {
+            std::uint64_t position = head - back;
+            HistoryRing::Entry& entry = const_cast<HistoryRing::Entry&>(ring.entries[position % HistoryRing::capacity]);
+            std::atomic_ref<std::uint32_t> sequence(entry.sequence);
+            if (sequence.load(std::memory_order_acquire) != static_cast<std::uint32_t>(position + 1)) {
+                continue;
+            }
+            StatementLine line{
+                static_cast<TransactionType>(std::atomic_ref<std::uint8_t>(entry.type).load(std::memory_order_relaxed)),
+                std::atomic_ref<std::int64_t>(entry.time_ns).load(std::memory_order_relaxed),
+                Money::from_cents(std::atomic_ref<std::int64_t>(entry.amount).load(std::memory_order_relaxed)),
+                Money::from_cents(std::atomic_ref<std::int64_t>(entry.balance).load(std::memory_order_relaxed))};
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == static_cast<std::uint32_t>(position + 1)) {
+                lines[copied++] = line;
+            }
+        }
+        return copied;
+    }
+
+    // Method to add a signed amount without checks, used by recovery. The caller must be
+    // the only thread touching this account, so a plain load and store are enough.
+    void adjust(AccountId id, std::int64_t delta) {
+        balances[id] += delta;
+    }
+
+    // Method to verify PIN
+    bool verify_pin(AccountId id, const PinCode& entered_pin) const {
+        return pins[id].matches(entered_pin);
+    }
+
+    // Method to get atomic access to an account's failed PIN attempts, a FailureWindow word
+    std::atomic_ref<std::uint64_t> pin_failure_ref(AccountId id) const {
+        return std::atomic_ref<std::uint64_t>(const_cast<std::uint64_t&>(pin_failures[id]));
+    }
+
+    // Method to check n PIN attempts at once, setting valid[i] for each. With the SHA
+    // extensions four attempts are hashed together in interleaved lanes.
+    void verify_pins(const AccountId* ids, const PinCode* entered, bool* valid, std::size_t n) const {
+        constexpr int lanes = 4;
+        std::size_t i = 0;
+        if (PinHash::batched()) {
+            for (; i + lanes <= n; i += lanes) {
+                alignas(64) std::uint8_t blocks[lanes][64];
+                std::uint32_t states[lanes][8];
+                std::uint32_t* state_pointers[lanes];
+                const std::uint8_t* block_pointers[lanes];
+                for (int l = 0; l < lanes; ++l) {
+                    PinHash::fill_block(pins[ids[i + l]].salt, entered[i + l], blocks[l]);
+                    PinHash::start_state(states[l]);
+                    state_pointers[l] = states[l];
+                    block_pointers[l] = blocks[l];
+                }
+                sha256_compress_shani_lanes<lanes>(state_pointers, block_pointers);
+                for (int l = 0; l < lanes; ++l) {
+                    valid[i + l] = pins[ids[i + l]].equals(states[l]);
+                }
+            }
+        }
+        for (; i < n; ++i) {
+            valid[i] = pins[ids[i]].matches(entered[i]);
+        }
+    }
+
+    // Method to drop all accounts
+    void clear() {
+        std::lock_guard<std::mutex> lock(append_mutex);
+        keys.clear();
+        pins.clear();
+        balances.clear();
+        products.clear();
+        versions.clear();
+        pin_failures.clear();
+        history.clear();
+        count.store(0, std::memory_order_release);
+    }
+
+    // Method to sum all balances in one pass over the balance array
+    Money total_balance() const {
+        std::int64_t total = 0;
+        balances.for_each_run(size(), [&total](const std::int64_t* run, std::size_t length) {
+            for (std::size_t i = 0; i < length; ++i) {
+                total += std::atomic_ref<std::int64_t>(const_cast<std::int64_t&>(run[i])).load(std::memory_order_relaxed);
+            }
+            return true;
+        });
+        return Money::from_cents(total);
+    }
+};
+
+// Account Class: Lightweight handle to one account in an AccountStore, provides methods
+// for deposit, withdrawal, and checking balance
 class Account {
 private:
-    std::string account_number;  // Private member to store account number
-    std::string pin;             // Private member to store PIN
-    double balance;              // Private member to store balance
+    AccountStore* store = nullptr;  // Private member to store the owning store
+    AccountId id = 0;               // Private member to store account id
+
+public:
+    // Default constructor creates a handle that refers to no account
+    Account() = default;
+
+    // Constructor to initialize the handle
+    Account(AccountStore* store, AccountId id) : store(store), id(id) {}
+
+    // Method to test whether the handle refers to an account
+    explicit operator bool() const {
+        return store != nullptr;
+    }
+
+    // Method to get account id
+    AccountId get_id() const {
+        return id;
+    }
+
+    // Method to check balance
+    Money check_balance() const {
+        return store->balance(id);
+    }
+
+    // Method to deposit amount
+    bool deposit(Money amount) {
+        return store->deposit(id, amount);
+    }
+
+    // Method to withdraw amount
+    bool withdraw(Money amount) {
+        return store->withdraw(id, amount);
+    }
+
+    // Method to transfer amount to another account in the same store
+    bool transfer_to(Account destination, Money amount) {
+        return store->transfer(id, destination.id, amount);
+    }
+
+    // Method to copy the most recent transactions, newest first; returns how many were copied
+    std::size_t recent_transactions(StatementLine* lines, std::size_t max_lines) const {
+        return store->recent_transactions(id, lines, max_lines);
+    }
+
+    // Method to verify PIN
+    bool verify_pin(const std::string& entered_pin) const {
+        PinCode pin;
+        return PinCode::from_string(entered_pin, pin) && store->verify_pin(id, pin);
+    }
+
+    // Method to get account number
+    std::string get_account_number() const {
+        return store->key(id).to_string();
+    }
+};
+
+// Session Class: Handle returned by a successful PIN check. It carries only the account's
+// dense 32-bit id, so it is four bytes, can be stored or sent anywhere, and every
+// following operation indexes the account arrays directly with no account number
+// hashing or comparison.
+class Session {
+private:
+    static constexpr AccountId no_account = 0xffffffffu;
+
+    AccountId id = no_account;  // Private member to store the authenticated account id
+
+public:
+    // Default constructor creates a session for no account
+    Session() = default;
+
+    // Constructor to open a session for an account id
+    explicit Session(AccountId id) : id(id) {}
+
+    // Method to test whether the session belongs to an account
+    explicit operator bool() const {
+        return id != no_account;
+    }
+
+    // Method to get the account id
+    AccountId account_id() const {
+        return id;
+    }
+};
+
+// TransactionResult Enum: Outcome of executing a transaction
+enum class TransactionResult : std::uint8_t {
+    Success,
+    Failed,
+    InvalidType,
+    InvalidAccount,
+};
+
+// Function to get the message shown to the user for a transaction result
+const char* to_message(TransactionResult result) {
+    switch (result) {
+    case TransactionResult::Success:
+        return "Transaction successful";
+    case TransactionResult::Failed:
+        return "Transaction failed";
+    case TransactionResult::InvalidAccount:
+        return "Invalid account";
+    case TransactionResult::InvalidType:
+        break;
+    }
+    return "Invalid transaction type";
+}
+
+// Deposit Class: Represents a deposit transaction
+class Deposit {
+private:
+    Account account;  // Private member to store account
+    Money amount;     // Private member to store deposit amount
+
+public:
+    // Constructor to initialize account and deposit amount
+    Deposit(Account account, Money amount) : account(account), amount(amount) {}
+
+    // Method to execute deposit transaction
+    bool execute() {
+        return account.deposit(amount);
+    }
+};
+
+// Withdrawal Class: Represents a withdrawal transaction
+class Withdrawal {
+private:
+    Account account;  // Private member to store account
+    Money amount;     // Private member to store withdrawal amount
+
+public:
+    // Constructor to initialize account and withdrawal amount
+    Withdrawal(Account account, Money amount) : account(account), amount(amount) {}
+
+    // Method to execute withdrawal transaction
+    bool execute() {
+        return account.withdraw(amount);
+    }
+};
+
+// Transfer Class: Represents a transfer between two accounts
+class Transfer {
+private:
+    Account account;      // Private member to store account the money leaves
+    Account destination;  // Private member to store account the money goes to
+    Money amount;         // Private member to store transfer amount
+
+public:
+    // Constructor to initialize both accounts and transfer amount
+    Transfer(Account account, Account destination, Money amount)
+        : account(account), destination(destination), amount(amount) {}
+
+    // Method to execute transfer transaction
+    bool execute() {
+        return account.transfer_to(destination, amount);
+    }
+};
+
+// Transaction Type: Represents a generic transaction as a value, so building and running
+// one needs no heap allocation and no virtual call
+using Transaction = std::variant<Deposit, Withdrawal, Transfer>;
+
+// Function to execute any transaction
+bool execute(Transaction& transaction) {
+    return std::visit([](auto& t) { return t.execute(); }, transaction);
+}
+
+// Function to hash a packed account number (64-bit finalizer from MurmurHash3)
+std::uint64_t hash_account_number(const AccountKey& key) {
+    std::uint64_t h = key.packed;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// AccountIndex Class: Open-addressing hash table mapping account numbers to account ids.
+// Slots are stored inline in one array and probed linearly, so a lookup touches one or
+// two cache lines instead of walking a chain of heap nodes. Each slot holds the packed
+// account number itself, so a probe is one integer compare and never reads the store.
+class AccountIndex {
+public:
+    struct Slot {
+        std::uint64_t key;       // Packed account number, 0 marks an empty slot
+        AccountId id;            // Account stored in this slot
+        std::uint32_t reserved;  // Keeps the slot layout fixed for snapshots
+    };
+
+private:
+    Slot* slots = nullptr;        // Private member to store slots, a power of two of them
+    std::size_t capacity = 0;     // Private member to store number of slots
+    std::size_t count = 0;        // Private member to store number of occupied slots
+    std::vector<Slot> owned;      // Private member to store slots owned by the index
+
+    // Method to double the table and reinsert all accounts
+    void grow() {
+        std::vector<Slot> grown(capacity == 0 ? 16 : capacity * 2, Slot{0, 0, 0});
+        std::size_t mask = grown.size() - 1;
+        for (std::size_t s = 0; s < capacity; ++s) {
+            if (slots[s].key != 0) {
+                std::size_t i = hash_account_number(AccountKey{slots[s].key}) & mask;
+                while (grown[i].key != 0) {
+                    i = (i + 1) & mask;
+                }
+                grown[i] = slots[s];
+            }
+        }
+        owned.swap(grown);
+        slots = owned.data();
+        capacity = owned.size();
+    }
+
+public:
+    // Method to reserve room for a number of accounts without rehashing
+    void reserve(std::size_t expected) {
+        while (capacity < expected * 2 || capacity == 0) {
+            grow();
+        }
+    }
+
+    // Method to insert an account id under its account number, given the number's hash;
+    // returns false if the account number is already present
+    bool insert(const AccountStore& store, AccountId id, std::uint64_t key_hash) {
+        if ((count + 1) * 4 > capacity * 3) {  // Keep load factor at or below 3/4
+            grow();
+        }
+        std::uint64_t key = store.key(id).packed;
+        std::size_t mask = capacity - 1;
+        std::size_t i = key_hash & mask;
+        while (slots[i].key != 0) {
+            if (slots[i].key == key) {
+                return false;
+            }
+            i = (i + 1) & mask;
+        }
+        slots[i] = Slot{key, id, 0};
+        ++count;
+        return true;
+    }
+
+    // Method to find an account id by account number and its hash, returns false if absent
+    bool find(const AccountKey& key, std::uint64_t key_hash, AccountId& id) const {
+        if (capacity == 0) {
+            return false;
+        }
+        std::size_t mask = capacity - 1;
+        for (std::size_t i = key_hash & mask; slots[i].key != 0; i = (i + 1) & mask) {
+            if (slots[i].key == key.packed) {
+                id = slots[i].id;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Method to use a slot table stored elsewhere, such as in a mapped snapshot. The
+    // table is copied into memory of its own when it next grows.
+    void attach(Slot* slot_data, std::size_t slot_count, std::size_t entries) {
+        owned.clear();
+        slots = slot_data;
+        capacity = slot_count;
+        count = entries;
+    }
+
+    // Method to remove every entry
+    void clear() {
+        owned.clear();
+        slots = nullptr;
+        capacity = 0;
+        count = 0;
+    }
+
+    // Method to get the slot table
+    const Slot* slot_data() const {
+        return slots;
+    }
+
+    // Method to get number of slots in the table
+    std::size_t slot_count() const {
+        return capacity;
+    }
+
+    // Method to get number of accounts in the index
+    std::size_t size() const {
+        return count;
+    }
+};
+
+// BloomStats Struct: Size and accuracy of the account number filter
+struct BloomStats {
+    std::size_t bytes = 0;              // Memory used by the filter
+    std::uint64_t keys = 0;             // Account numbers added
+    std::uint64_t capacity = 0;         // Account numbers the filter is sized for
+    double fill = 0;                    // Fraction of bits set
+    double estimated_fpr = 0;           // Chance an unknown number passes, from the fill
+    std::uint64_t false_positives = 0;  // Lookups that passed the filter but found nothing
+};
+
+// BloomFilter Class: Blocked Bloom filter over account number hashes. Each key maps to one
+// 64-byte block and sets one bit in each of the block's eight words, so a lookup reads
+// a single cache line. Bits are set with atomic ORs, so lookups need no lock while
+// accounts are added.
+class BloomFilter {
+public:
+    // Block Struct: One cache line of filter bits
+    struct alignas(64) Block {
+        std::uint64_t words[8];
+    };
+
+    static constexpr std::size_t bits_per_key = 16;
+
+private:
+    Block* blocks = nullptr;          // Private member to store the filter bits
+    std::unique_ptr<Block[]> owned;   // Private member to store bits owned by the filter
+    unsigned block_bits = 0;          // Private member to store log2 of the block count
+
+    // Method to pick the block and the bit in each word for a hash. The hash is remixed
+    // so the choice does not line up with the index shard and slot bits.
+    std::size_t locate(std::uint64_t hash, std::uint64_t& bits) const {
+        std::uint64_t mixed = hash * 0x9e3779b97f4a7c15ull;
+        bits = (hash ^ (hash >> 29)) * 0xbf58476d1ce4e5b9ull;
+        return block_bits == 0 ? 0 : static_cast<std::size_t>(mixed >> (64 - block_bits));
+    }
+
+public:
+    // Constructor to create an empty filter sized for capacity keys
+    explicit BloomFilter(std::size_t capacity) {
+        std::size_t wanted = (capacity * bits_per_key + 511) / 512;
+        while ((std::size_t(1) << block_bits) < wanted) {
+            ++block_bits;
+        }
+        owned.reset(new Block[std::size_t(1) << block_bits]());
+        blocks = owned.get();
+    }
+
+    // Constructor to use filter bits stored elsewhere, such as in a mapped snapshot;
+    // block_count must be a power of two
+    BloomFilter(Block* block_data, std::size_t block_count) : blocks(block_data) {
+        while ((std::size_t(2) << block_bits) <= block_count) {
+            ++block_bits;
+        }
+    }
+
+    // Method to add a hash
+    void add(std::uint64_t hash) {
+        std::uint64_t bits;
+        Block& block = blocks[locate(hash, bits)];
+        for (int i = 0; i < 8; ++i, bits >>= 6) {
+            std::atomic_ref<std::uint64_t>(block.words[i])
+                .fetch_or(std::uint64_t(1) << (bits & 63), std::memory_order_relaxed);
+        }
+    }
+
+    // Method to test a hash; false means the hash was certainly never added
+    bool may_contain(std::uint64_t hash) const {
+        std::uint64_t bits;
+        const Block& block = blocks[locate(hash, bits)];
+        bool present = true;
+        for (int i = 0; i < 8; ++i, bits >>= 6) {
+            std::uint64_t word =
+                std::atomic_ref<std::uint64_t>(const_cast<std::uint64_t&>(block.words[i])).load(std::memory_order_relaxed);
+            present &= (word >> (bits & 63)) & 1;
+        }
+        return present;
+    }
+
+    // Method to get the number of blocks
+    std::size_t block_count() const {
+        return std::size_t(1) << block_bits;
+    }
+
+    // Method to get the number of keys the filter is sized for
+    std::size_t capacity() const {
+        return block_count() * 512 / bits_per_key;
+    }
+
+    // Method to get the filter bits, for snapshots
+    const Block* data() const {
+        return blocks;
+    }
+
+    // Method to count the set bits and estimate the false-positive rate from them: an
+    // unknown key passes if the bit it picks is set in each of the eight words
+    void measure(BloomStats& stats) const {
+        std::uint64_t set = 0;
+        for (std::size_t b = 0; b < block_count(); ++b) {
+            for (std::uint64_t word : blocks[b].words) {
+                set += static_cast<std::uint64_t>(__builtin_popcountll(word));
+            }
+        }
+        stats.bytes = block_count() * sizeof(Block);
+        stats.capacity = capacity();
+        stats.fill = static_cast<double>(set) / (block_count() * 512.0);
+        stats.estimated_fpr = std::pow(stats.fill, 8);
+    }
+};
+
+// ShardedAccountIndex Class: Account index split into a power-of-two number of shards,
+// each an AccountIndex with its own reader/writer lock. The shard is chosen by the top
+// bits of the account number hash (slots inside a shard use the low bits), so terminals
+// looking up or adding accounts in different shards never wait for each other, and
+// lookups in the same shard only share a read lock.
+class ShardedAccountIndex {
+private:
+    struct alignas(64) Shard {
+        mutable std::shared_mutex lock;  // Guards index
+        AccountIndex index;              // Accounts whose hash falls in this shard
+    };
+
+    unsigned shard_bits;              // Private member to store log2 of the shard count
+    std::unique_ptr<Shard[]> shards;  // Private member to store the shards
+    std::atomic<BloomFilter*> filter;  // Private member to store the filter checked before any shard is locked
+    // Private member to store every filter built so far. A filter replaced by a larger one
+    // is kept, since lock-free lookups may still be reading it; each is at most half the
+    // size of the next, so the old ones cost less than the current one.
+    std::vector<std::unique_ptr<BloomFilter>> filters;
+    std::atomic<std::size_t> entries{0};         // Private member to store accounts added
+    mutable std::atomic<std::uint64_t> false_positives{0};  // Private member to store lookups the filter let through in vain
+
+    // Method to replace the filter with one sized for at least capacity keys and add
+    // every indexed hash to it; callers must hold every shard's write lock
+    void rebuild_filter(std::size_t capacity) {
+        filters.push_back(std::make_unique<BloomFilter>(capacity));
+        BloomFilter* rebuilt = filters.back().get();
+        for (std::size_t s = 0; s < shard_count(); ++s) {
+            const AccountIndex& index = shards[s].index;
+            for (std::size_t i = 0; i < index.slot_count(); ++i) {
+                if (index.slot_data()[i].key != 0) {
+                    rebuilt->add(hash_account_number(AccountKey{index.slot_data()[i].key}));
+                }
+            }
+        }
+        filter.store(rebuilt, std::memory_order_release);
+    }
+
+    // Method to double the filter once more accounts were added than it is sized for
+    void grow_filter() {
+        with_all_locked([&] {
+            std::size_t capacity = filter.load(std::memory_order_relaxed)->capacity();
+            if (entries.load(std::memory_order_relaxed) > capacity) {
+                rebuild_filter(capacity * 2);
+            }
+        });
+    }
+
+    // Method to pick the shard for a hash
+    std::size_t shard_of(std::uint64_t hash) const {
+        return shard_bits == 0 ? 0 : static_cast<std::size_t>(hash >> (64 - shard_bits));
+    }
+
+public:
+    // Constructor to create 2^shard_bits empty shards
+    explicit ShardedAccountIndex(unsigned shard_bits = 6)
+        : shard_bits(shard_bits), shards(new Shard[std::size_t(1) << shard_bits]) {
+        filters.push_back(std::make_unique<BloomFilter>(1024));
+        filter.store(filters.back().get(), std::memory_order_relaxed);
+    }
+
+    // Method to get number of shards
+    std::size_t shard_count() const {
+        return std::size_t(1) << shard_bits;
+    }
+
+    // Method to get the shard an account number belongs to
+    std::size_t shard_of(const AccountKey& key) const {
+        return shard_of(hash_account_number(key));
+    }
+
+    // Method to reserve room for a number of accounts without rehashing
+    void reserve(std::size_t expected) {
+        for (std::size_t s = 0; s < shard_count(); ++s) {
+            std::unique_lock<std::shared_mutex> lock(shards[s].lock);
+            shards[s].index.reserve(expected / shard_count() + 1);
+        }
+        with_all_locked([&] {
+            if (expected > filter.load(std::memory_order_relaxed)->capacity()) {
+                rebuild_filter(expected);
+            }
+        });
+    }
+
+    // Method to add an account if its number is new. create() appends the account to the
+    // store and returns its id; it runs under the shard's write lock, so two terminals
+    // adding the same number cannot both succeed. Returns false if the number exists.
+    template <typename Create>
+    bool add(const AccountStore& store, const AccountKey& key, Create&& create, AccountId& id) {
+        std::uint64_t hash = hash_account_number(key);
+        Shard& shard = shards[shard_of(hash)];
+        std::unique_lock<std::shared_mutex> lock(shard.lock);
+        if (shard.index.find(key, hash, id)) {
+            return false;
+        }
+        id = create();
+        filter.load(std::memory_order_relaxed)->add(hash);  // Set before the entry is visible
+        shard.index.insert(store, id, hash);
+        lock.unlock();
+        if (entries.fetch_add(1, std::memory_order_relaxed) + 1 > filter.load(std::memory_order_relaxed)->capacity()) {
+            grow_filter();
+        }
+        return true;
+    }
+
+    // Method to insert an existing account id under its account number
+    bool insert(const AccountStore& store, AccountId id) {
+        std::uint64_t hash = hash_account_number(store.key(id));
+        Shard& shard = shards[shard_of(hash)];
+        std::unique_lock<std::shared_mutex> lock(shard.lock);
+        filter.load(std::memory_order_relaxed)->add(hash);
+        if (!shard.index.insert(store, id, hash)) {
+            return false;
+        }
+        lock.unlock();
+        if (entries.fetch_add(1, std::memory_order_relaxed) + 1 > filter.load(std::memory_order_relaxed)->capacity()) {
+            grow_filter();
+        }
+        return true;
+    }
+
+    // Method to find an account id by account number, returns false if absent. Numbers
+    // the filter has never seen are rejected before any shard is locked or probed.
+    bool find(const AccountKey& key, AccountId& id) const {
+        std::uint64_t hash = hash_account_number(key);
+        if (!filter.load(std::memory_order_acquire)->may_contain(hash)) {
+            return false;
+        }
+        const Shard& shard = shards[shard_of(hash)];
+        std::shared_lock<std::shared_mutex> lock(shard.lock);
+        if (!shard.index.find(key, hash, id)) {
+            false_positives.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // Method to get the filter's size and accuracy
+    BloomStats filter_stats() const {
+        BloomStats stats;
+        filter.load(std::memory_order_acquire)->measure(stats);
+        stats.keys = entries.load(std::memory_order_relaxed);
+        stats.false_positives = false_positives.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // Method to get the current filter, for snapshots; callers must hold the shard locks
+    const BloomFilter& current_filter() const {
+        return *filter.load(std::memory_order_relaxed);
+    }
+
+    // Method to use filter bits stored elsewhere, such as in a mapped snapshot, for the
+    // entries attached so far
+    void attach_filter(BloomFilter::Block* block_data, std::size_t block_count) {
+        with_all_locked([&] {
+            filters.push_back(std::make_unique<BloomFilter>(block_data, block_count));
+            filter.store(filters.back().get(), std::memory_order_release);
+        });
+    }
+
+    // Method to run a callback while holding every shard's write lock
+    template <typename Callback>
+    void with_all_locked(Callback&& callback) {
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        for (std::size_t s = 0; s < shard_count(); ++s) {
+            locks.emplace_back(shards[s].lock);
+        }
+        callback();
+    }
+
+    // Method to get one shard's table, for snapshots; callers must hold the shard locks
+    const AccountIndex& shard(std::size_t s) const {
+        return shards[s].index;
+    }
+
+    // Method to use one shard's slot table stored elsewhere, such as in a mapped snapshot
+    void attach(std::size_t s, AccountIndex::Slot* slot_data, std::size_t slot_count, std::size_t entries) {
+        std::unique_lock<std::shared_mutex> lock(shards[s].lock);
+        shards[s].index.attach(slot_data, slot_count, entries);
+        this->entries.fetch_add(entries, std::memory_order_relaxed);
+    }
+
+    // Method to remove every entry
+    void clear() {
+        with_all_locked([&] {
+            for (std::size_t s = 0; s < shard_count(); ++s) {
+                shards[s].index.clear();
+            }
+            rebuild_filter(1024);
+        });
+        entries.store(0, std::memory_order_relaxed);
+        false_positives.store(0, std::memory_order_relaxed);
+    }
+
+    // Method to get number of accounts in the index
+    std::size_t size() const {
+        std::size_t total = 0;
+        for (std::size_t s = 0; s < shard_count(); ++s) {
+            std::shared_lock<std::shared_mutex> lock(shards[s].lock);
+            total += shards[s].index.size();
+        }
+        return total;
+    }
+};
+
+// JournalRecord Struct: Fixed-size binary record for one executed transaction. Besides
+// what replay needs, it carries the time and the resulting balances, so the transaction
+// history can be built from the journal alone.
+struct JournalRecord {
+    std::uint64_t lsn;                  // Log sequence number, increases by one per record
+    std::int64_t amount;                // Transaction amount in cents
+    std::int64_t time_us;               // Wall-clock time, microseconds since the Unix epoch
+    std::int64_t balance;               // Balance of account right after the transaction
+    std::int64_t counterparty_balance;  // Balance of counterparty right after a transfer, otherwise 0
+    AccountId account;                  // Account the transaction was applied to
+    AccountId counterparty;             // Destination account of a transfer, otherwise 0
+    std::uint8_t type;                  // TransactionType of the transaction
+    std::uint8_t reserved[7];
+};
+static_assert(sizeof(JournalRecord) == 56, "JournalRecord is an on-disk format");
+
+// AccountOpening Struct: An account added while a journal is attached, with everything
+// needed to recreate it. It is journaled as a group of opening_records records with
+// consecutive sequence numbers: an Open record holding the id, the opening balance and
+// the account number (in counterparty_balance), then two OpenDetail records that each
+// carry half of the PIN hash in their amount, balance and counterparty_balance fields.
+struct AccountOpening {
+    static constexpr std::size_t opening_records = 3;
+    static constexpr std::size_t detail_bytes = 3 * sizeof(std::int64_t);  // PIN hash bytes per OpenDetail record
+    static_assert(2 * detail_bytes == sizeof(PinHash), "two OpenDetail records hold a PIN hash");
+
+    AccountId id = 0;          // Id the account was given
+    AccountKey key{};          // Account number
+    PinHash pin{};             // Salted PIN hash
+    std::int64_t balance = 0;  // Opening balance in cents
+
+    // Method to fill a group of zeroed records, leaving the sequence numbers and times to
+    // the journal
+    void encode(JournalRecord* records) const {
+        const std::uint8_t* bytes = reinterpret_cast<const std::uint8_t*>(&pin);
+        records[0].type = static_cast<std::uint8_t>(TransactionType::Open);
+        records[0].account = id;
+        records[0].amount = balance;
+        records[0].balance = balance;
+        records[0].counterparty_balance = static_cast<std::int64_t>(key.packed);
+        for (std::size_t part = 0; part < 2; ++part) {
+            JournalRecord& record = records[1 + part];
+            const std::uint8_t* half = bytes + part * detail_bytes;
+            record.type = static_cast<std::uint8_t>(TransactionType::OpenDetail);
+            record.account = id;
+            record.counterparty = static_cast<AccountId>(part);
+            std::memcpy(&record.amount, half, sizeof(std::int64_t));
+            std::memcpy(&record.balance, half + sizeof(std::int64_t), sizeof(std::int64_t));
+            std::memcpy(&record.counterparty_balance, half + 2 * sizeof(std::int64_t), sizeof(std::int64_t));
+        }
+    }
+
+    // Method to read an opening back from the count records starting at an Open record.
+    // Returns false if the group is incomplete, such as when a crash cut it short.
+    bool decode(const JournalRecord* records, std::size_t count) {
+        if (count < opening_records || records[0].type != static_cast<std::uint8_t>(TransactionType::Open)) {
+            return false;
+        }
+        std::uint8_t* bytes = reinterpret_cast<std::uint8_t*>(&pin);
+        for (std::size_t part = 0; part < 2; ++part) {
+            const JournalRecord& record = records[1 + part];
+            if (record.type != static_cast<std::uint8_t>(TransactionType::OpenDetail) ||
+                record.lsn != records[0].lsn + 1 + part || record.account != records[0].account ||
+                record.counterparty != part) {
+                return false;
+            }
+            std::uint8_t* half = bytes + part * detail_bytes;
+            std::memcpy(half, &record.amount, sizeof(std::int64_t));
+            std::memcpy(half + sizeof(std::int64_t), &record.balance, sizeof(std::int64_t));
+            std::memcpy(half + 2 * sizeof(std::int64_t), &record.counterparty_balance, sizeof(std::int64_t));
+        }
+        id = records[0].account;
+        key.packed = static_cast<std::uint64_t>(records[0].counterparty_balance);
+        balance = records[0].amount;
+        return true;
+    }
+};
+
+// Durability Enum: When a journaled transaction is acknowledged
+enum class Durability : std::uint8_t {
+    Async,        // Acknowledge once buffered, the record reaches disk within one group window
+    GroupCommit,  // Acknowledge only after the batch holding the record has been fsynced
+};
+
+// JournalOptions Struct: Durability/latency settings for the journal
+struct JournalOptions {
+    Durability durability = Durability::GroupCommit;
+    std::chrono::microseconds group_window{500};  // How long the flusher gathers a batch
+    std::size_t max_batch_records = 8192;         // Batch size that triggers an early flush
+};
+
+// Journal Class: Append-only write-ahead log of executed transactions. Records are
+// buffered in memory and a background flusher writes and fsyncs whole batches, so many
+// concurrent transactions share one fsync (group commit). The journal lives in a
+// directory of numbered segment files; each run appends to a fresh segment.
+// Records are queued on one of stripe_count stripes chosen by account, so transactions
+// on accounts of different stripes never wait for each other. The flusher drains every
+// stripe and writes the records in sequence-number order.
+class Journal {
+private:
+    // Stripe Struct: A lock held while a transaction on its accounts runs, and the
+    // records queued under it
+    struct alignas(64) Stripe {
+        std::mutex mutex;                    // Guards pending
+        std::vector<JournalRecord> pending;  // Records not yet handed to the flusher
+    };
+    static constexpr std::size_t stripe_count = 64;
+
+    std::string directory;                  // Private member to store journal directory
+    JournalOptions options;                 // Private member to store durability settings
+    int fd = -1;                            // Private member to store open segment file
+    std::uint64_t segment = 0;              // Private member to store open segment number
+    std::array<Stripe, stripe_count> stripes;  // Private member to store the record queues
+    std::atomic<std::uint64_t> next_lsn{1};    // Sequence number of the next record
+    std::atomic<std::uint64_t> wake_lsn{1};    // Sequence number whose append wakes the flusher
+    std::mutex mutex;                       // Guards everything below
+    std::condition_variable work_ready;     // Signalled when records are waiting to be flushed
+    std::condition_variable batch_durable;  // Signalled after each fsync
+    std::uint64_t durable_lsn = 0;          // Highest sequence number known to be on disk
+    bool stopping = false;                  // Set when the flusher should exit
+    bool rotate_requested = false;          // Set when the next batch should start a new segment
+    std::function<void(const JournalRecord*, std::size_t)> listener;  // Called with each batch once on disk
+    int durable_fd = -1;                    // Eventfd signalled after each fsync, once requested
+    std::thread flusher;                    // Background flush thread
+
+    // Method to write a whole buffer, aborting on I/O errors since acknowledged
+    // transactions could otherwise be lost silently
+    static void write_all(int fd, const void* data, std::size_t size) {
+        if (!write_fully(fd, data, size)) {
+            std::perror("journal write");
+            std::abort();
+        }
+    }
+
+    // Method to close the open segment and continue in the next one
+    void open_next_segment(std::uint64_t next) {
+        ::close(fd);
+        fd = ::open(segment_path(directory, next).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0 || !sync_directory(directory)) {
+            std::perror("journal rotate");
+            std::abort();
+        }
+    }
+
+    // Method to get the stripe of an account
+    Stripe& stripe_of(AccountId account) {
+        return stripes[account % stripe_count];
+    }
+
+    // Method to number count records, time them and queue them on a stripe the caller has
+    // locked. The numbers are taken under the lock, so the records of each account are
+    // numbered in the order the account changed. Returns the last sequence number.
+    std::uint64_t queue(Stripe& stripe, JournalRecord* records, std::size_t count) {
+        std::int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::system_clock::now().time_since_epoch()).count();
+        std::uint64_t first = next_lsn.fetch_add(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            records[i].lsn = first + i;
+            records[i].time_us = now;
+            stripe.pending.push_back(records[i]);
+        }
+        return first + count - 1;
+    }
+
+    // Method to wake the flusher if the records first..last include the one it waits for.
+    // next_lsn was advanced before wake_lsn is read here, and the flusher sets wake_lsn
+    // before reading next_lsn, so one of the two always sees the other.
+    void wake_flusher(std::uint64_t first, std::uint64_t last) {
+        std::uint64_t wake = wake_lsn.load();
+        if (wake >= first && wake <= last) {
+            std::lock_guard<std::mutex> lock(mutex);
+            work_ready.notify_one();
+        }
+    }
+
+    // Method run by the flusher thread. Each batch is every record numbered below the
+    // next_lsn read when the group window ends; records queued meanwhile with higher
+    // numbers wait for the next batch, so batches are written in sequence-number order.
+    void flush_loop() {
+        std::vector<JournalRecord> batch, later;
+        std::unique_lock<std::mutex> lock(mutex);
+        std::uint64_t flushed = durable_lsn;
+        while (true) {
+            wake_lsn.store(flushed + 1);  // The first record appended wakes the flusher
+            work_ready.wait(lock, [&] { return stopping || next_lsn.load() > flushed + 1; });
+            if (next_lsn.load() == flushed + 1) {
+                break;  // Stopping and nothing left to flush
+            }
+            // Give concurrent transactions one window to join this batch
+            wake_lsn.store(flushed + options.max_batch_records);
+            work_ready.wait_for(lock, options.group_window, [&] {
+                return stopping || next_lsn.load() > flushed + options.max_batch_records;
+            });
+            wake_lsn.store(0);
+            std::uint64_t end = next_lsn.load();
+            bool rotate = rotate_requested;
+            if (rotate) {
+                rotate_requested = false;
+                ++segment;  // This batch and everything after it goes to the next segment
+            }
+            std::uint64_t target = segment;
+            lock.unlock();
+
+            // Every record numbered below end was queued before its stripe lock was
+            // released, so draining each stripe under its lock finds all of them
+            batch.swap(later);
+            later.clear();
+            for (Stripe& stripe : stripes) {
+                std::lock_guard<std::mutex> drain(stripe.mutex);
+                batch.insert(batch.end(), stripe.pending.begin(), stripe.pending.end());
+                stripe.pending.clear();
+            }
+            auto split = std::partition(batch.begin(), batch.end(),
+                                        [end](const JournalRecord& record) { return record.lsn < end; });
+            later.assign(split, batch.end());
+            batch.erase(split, batch.end());
+            std::sort(batch.begin(), batch.end(),
+                      [](const JournalRecord& a, const JournalRecord& b) { return a.lsn < b.lsn; });
+
+            if (rotate) {
+                open_next_segment(target);
+            }
+            write_all(fd, batch.data(), batch.size() * sizeof(JournalRecord));
+            if (::fdatasync(fd) != 0) {
+                std::perror("journal fdatasync");
+                std::abort();
+            }
+            if (listener) {
+                listener(batch.data(), batch.size());
+            }
+
+            lock.lock();
+            flushed = end - 1;
+            durable_lsn = flushed;
+            batch.clear();
+            batch_durable.notify_all();
+            if (durable_fd >= 0) {
+                std::uint64_t one = 1;
+                [[maybe_unused]] ssize_t n = ::write(durable_fd, &one, sizeof(one));
+            }
+        }
+    }
+
+    // Method to run f with every stripe locked, so that no transaction is in flight
+    template <typename F>
+    auto with_all_stripes(F&& f) {
+        std::array<std::unique_lock<std::mutex>, stripe_count> locks;
+        for (std::size_t i = 0; i < stripe_count; ++i) {
+            locks[i] = std::unique_lock<std::mutex>(stripes[i].mutex);
+        }
+        return f();
+    }
+
+public:
+    // Method to get the file name of a journal segment
+    static std::string segment_path(const std::string& directory, std::uint64_t segment) {
+        char name[48];
+        std::snprintf(name, sizeof(name), "journal-%06llu.log", static_cast<unsigned long long>(segment));
+        return directory + "/" + name;
+    }
+
+    // Method to list the segment numbers present in a journal directory, in order
+    static std::vector<std::uint64_t> list_segments(const std::string& directory) {
+        std::vector<std::uint64_t> segments;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+            unsigned long long number;
+            char tail;
+            if (std::sscanf(entry.path().filename().c_str(), "journal-%llu.lo%c", &number, &tail) == 2 && tail == 'g') {
+                segments.push_back(number);
+            }
+        }
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    ~Journal() {
+        close();
+        if (durable_fd >= 0) {
+            ::close(durable_fd);
+        }
+    }
+
+    // Method to open a new segment in the journal directory and start the flusher,
+    // numbering records from first_lsn (one past the last record recovered)
+    bool open(const std::string& journal_directory, const JournalOptions& journal_options = JournalOptions(),
+              std::uint64_t first_lsn = 1) {
+        // Note which directories are about to be created: each new entry is durable only
+        // once the directory that holds it has been synced too
+        std::vector<std::string> created;
+        std::error_code ec;
+        for (std::filesystem::path path = journal_directory; !path.empty() && !std::filesystem::exists(path, ec);
+             path = path.parent_path()) {
+            std::filesystem::path parent = path.parent_path();
+            created.push_back(parent.empty() ? std::string(".") : parent.string());
+            if (parent == path) {
+                break;
+            }
+        }
+        std::filesystem::create_directories(journal_directory, ec);
+        std::vector<std::uint64_t> segments = list_segments(journal_directory);
+        directory = journal_directory;
+        options = journal_options;
+        segment = segments.empty() ? 1 : segments.back() + 1;
+        next_lsn.store(first_lsn);
+        durable_lsn = first_lsn - 1;
+        fd = ::open(segment_path(directory, segment).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0 || !sync_directory(directory) ||
+            !std::all_of(created.begin(), created.end(), [](const std::string& parent) { return sync_directory(parent); })) {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+            return false;
+        }
+        stopping = false;
+        flusher = std::thread(&Journal::flush_loop, this);
+        return true;
+    }
+
+    // Method to flush outstanding records and close the segment
+    void close() {
+        if (fd < 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_one();
+        flusher.join();
+        ::close(fd);
+        fd = -1;
+    }
+
+    // Method to get the journal directory
+    const std::string& get_directory() const {
+        return directory;
+    }
+
+    // Method to have every batch of records passed to a callback, in order, once it is on
+    // disk. The callback runs on the flusher thread; set it before appending any records.
+    void set_listener(std::function<void(const JournalRecord*, std::size_t)> callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        listener = std::move(callback);
+    }
+
+    // Method to run a callback at a consistent cut of the journal: while it runs no
+    // transaction can commit, and the balances reflect exactly the records up to last_lsn.
+    // All records after the cut land in first_segment or later, and the flusher is asked
+    // to start a new segment so that first_segment stops growing.
+    template <typename Callback>
+    void freeze(Callback&& callback) {
+        with_all_stripes([&] {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::uint64_t first_segment = segment;
+            std::uint64_t last_lsn = next_lsn.load() - 1;
+            callback(first_segment, last_lsn);
+            rotate_requested = true;
+        });
+    }
+
+    // Method to delete segments that only hold records covered by a snapshot
+    void remove_segments_before(std::uint64_t first_segment) {
+        for (std::uint64_t number : list_segments(directory)) {
+            if (number < first_segment) {
+                ::unlink(segment_path(directory, number).c_str());
+            }
+        }
+    }
+
+    // Method to run a transaction and queue its record without waiting for the disk. The
+    // transaction runs under the stripe locks of the accounts it touches (both, in stripe
+    // order, for a transfer), so the records of each account are numbered in the order its
+    // balance changed; failed transactions are not journaled. apply(record) runs the
+    // transaction and fills in the resulting balances. Returns the record's sequence
+    // number, or 0 if the transaction failed.
+    template <typename Apply>
+    std::uint64_t append(Apply&& apply, TransactionType type, AccountId account, Money amount,
+                         AccountId counterparty = 0) {
+        JournalRecord record{};
+        record.amount = amount.to_cents();
+        record.account = account;
+        record.counterparty = counterparty;
+        record.type = static_cast<std::uint8_t>(type);
+        Stripe* first = &stripe_of(account);
+        Stripe* second = type == TransactionType::Transfer ? &stripe_of(counterparty) : first;
+        if (second < first) {
+            std::swap(first, second);
+        }
+        std::uint64_t lsn;
+        {
+            std::unique_lock<std::mutex> first_lock(first->mutex);
+            std::unique_lock<std::mutex> second_lock;
+            if (second != first) {
+                second_lock = std::unique_lock<std::mutex>(second->mutex);
+            }
+            if (!apply(record)) {
+                return 0;
+            }
+            lsn = queue(*first, &record, 1);
+        }
+        wake_flusher(lsn, lsn);
+        return lsn;
+    }
+
+    // Method to run a change that journals Count records, such as an account opening. The
+    // records get consecutive sequence numbers with no other record between them, and
+    // always land in the same batch and segment. apply(records) runs the change with every
+    // stripe locked and fills in the zeroed records. Returns the last record's sequence
+    // number, or 0 if the change failed.
+    template <std::size_t Count, typename Apply>
+    std::uint64_t append_group(Apply&& apply) {
+        std::array<JournalRecord, Count> records{};
+        std::uint64_t lsn = with_all_stripes([&]() -> std::uint64_t {
+            return apply(records.data()) ? queue(stripes[0], records.data(), Count) : 0;
+        });
+        if (lsn != 0) {
+            wake_flusher(lsn + 1 - Count, lsn);
+        }
+        return lsn;
+    }
+
+    // Method to test whether records must be on disk before they are acknowledged
+    bool waits_for_disk() const {
+        return options.durability == Durability::GroupCommit;
+    }
+
+    // Method to get the highest sequence number known to be on disk
+    std::uint64_t get_durable_lsn() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return durable_lsn;
+    }
+
+    // Method to get a non-blocking eventfd that becomes readable after each fsync, so an
+    // event loop can learn that durable_lsn moved without a thread waiting on the journal.
+    // Read it before get_durable_lsn, so no fsync is missed. Returns -1 on failure.
+    int durable_events() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (durable_fd < 0) {
+            durable_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+        return durable_fd;
+    }
+
+    // Method to wait until every record up to lsn is on disk, whatever the durability
+    // setting
+    void wait_flushed(std::uint64_t lsn) {
+        std::unique_lock<std::mutex> lock(mutex);
+        batch_durable.wait(lock, [this, lsn] { return durable_lsn >= lsn; });
+    }
+
+    // Method to wait until every record up to lsn is on disk, if the durability setting
+    // requires it before acknowledging
+    void wait_durable(std::uint64_t lsn) {
+        if (waits_for_disk()) {
+            wait_flushed(lsn);
+        }
+    }
+
+    // Method to run a transaction, journal it and wait until it may be acknowledged
+    template <typename Apply>
+    bool commit(Apply&& apply, TransactionType type, AccountId account, Money amount, AccountId counterparty = 0) {
+        std::uint64_t lsn = append(std::forward<Apply>(apply), type, account, amount, counterparty);
+        if (lsn == 0) {
+            return false;
+        }
+        wait_durable(lsn);
+        return true;
+    }
+};
+
+// ReplayStats Struct: What a journal replay did and how long it took
+struct ReplayStats {
+    bool snapshot = false;        // Whether a snapshot was loaded first
+    std::uint64_t snapshot_accounts = 0;  // Accounts loaded from the snapshot
+    std::uint64_t records = 0;    // Records applied
+    std::uint64_t opened = 0;     // Accounts recreated from their Open records
+    std::uint64_t skipped = 0;    // Records naming an unknown account or type
+    std::uint64_t last_lsn = 0;   // Highest sequence number seen
+    std::size_t segments = 0;     // Segment files read
+    unsigned workers = 0;         // Threads used
+    double seconds = 0;           // Wall-clock time of the replay
+};
+
+// JournalReplayer Class: Rebuilds balances from journal segments after a restart.
+// Transactions on different accounts commute, so the journal is mapped once and shared by
+// worker threads, each applying its own accounts' records in journal order:
+//   1. every worker scans one slice of the journal for Open record groups, and the accounts
+//      opened since the snapshot are recreated in id order,
+//   2. every worker scans the whole journal and applies only the records of the accounts it
+//      owns, with plain stores. Nothing is buffered, so memory stays flat however long the journal.
+// Accounts are assigned to owners in groups of eight so no two workers write to the
+// same cache line of the balance array.
+class JournalReplayer {
+private:
+    struct Segment {
+        void* base = MAP_FAILED;        // Mapped segment file
+        std::size_t bytes = 0;          // Mapped length
+        const JournalRecord* records = nullptr;
+        std::size_t count = 0;          // Whole records in the segment
+    };
+
+    // Method to map a segment read-only, ignoring a torn record at its end
+    static bool map_segment(const std::string& path, Segment& segment) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        segment.bytes = static_cast<std::size_t>(st.st_size);
+        segment.count = segment.bytes / sizeof(JournalRecord);
+        if (segment.count > 0) {
+            segment.base = ::mmap(nullptr, segment.bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (segment.base == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+            ::madvise(segment.base, segment.bytes, MADV_SEQUENTIAL);
+            segment.records = static_cast<const JournalRecord*>(segment.base);
+        }
+        ::close(fd);
+        return true;
+    }
+
+public:
+    // Method to call f(record) for every record after after_lsn, in journal order, on the
+    // calling thread
+    template <typename F>
+    static void for_each_record(const std::string& directory, std::uint64_t after_lsn, F&& f) {
+        for (std::uint64_t number : Journal::list_segments(directory)) {
+            Segment segment;
+            if (!map_segment(Journal::segment_path(directory, number), segment)) {
+                continue;
+            }
+            for (std::size_t i = 0; i < segment.count; ++i) {
+                if (segment.records[i].lsn > after_lsn) {
+                    f(segment.records[i]);
+                }
+            }
+            if (segment.base != MAP_FAILED) {
+                ::munmap(segment.base, segment.bytes);
+            }
+        }
+    }
+
+    // Method to replay every record after after_lsn from segments numbered first_segment
+    // or later into the store. open_account(opening) recreates each account opened in that
+    // part of the journal and returns false if it cannot.
+    template <typename OpenAccount>
+    static ReplayStats replay(const std::string& directory, AccountStore& store, OpenAccount&& open_account,
+                              unsigned workers = 0, std::uint64_t first_segment = 0, std::uint64_t after_lsn = 0) {
+        auto started = std::chrono::steady_clock::now();
+        ReplayStats stats;
+        if (workers == 0) {
+            workers = std::max(1u, std::thread::hardware_concurrency());
+        }
+        stats.workers = workers;
+
+        std::vector<Segment> segments;
+        std::size_t total = 0;
+        for (std::uint64_t number : Journal::list_segments(directory)) {
+            Segment segment;
+            if (number >= first_segment && map_segment(Journal::segment_path(directory, number), segment)) {
+                total += segment.count;
+                segments.push_back(segment);
+            }
+        }
+        stats.segments = segments.size();
+
+        std::vector<std::vector<AccountOpening>> openings(workers);
+        std::vector<std::uint64_t> applied(workers, 0), skipped(workers, 0), last_lsn(workers, 0);
+
+        std::vector<std::thread> threads;
+        for (unsigned w = 0; w < workers; ++w) {
+            threads.emplace_back([&, w] {
+                // Phase 1: collect the openings in slice w of the journal
+                std::size_t begin = total * w / workers;
+                std::size_t end = total * (w + 1) / workers;
+                std::size_t seg = 0;
+                std::size_t offset = begin;
+                while (seg < segments.size() && offset >= segments[seg].count) {
+                    offset -= segments[seg].count;
+                    ++seg;
+                }
+                for (std::size_t i = begin; i < end; ++i, ++offset) {
+                    while (offset >= segments[seg].count) {
+                        offset = 0;
+                        ++seg;
+                    }
+                    const JournalRecord& record = segments[seg].records[offset];
+                    if (record.lsn <= after_lsn) {
+                        continue;  // Already part of the snapshot
+                    }
+                    last_lsn[w] = std::max(last_lsn[w], record.lsn);
+                    if (record.type != static_cast<std::uint8_t>(TransactionType::Open)) {
+                        continue;
+                    }
+                    // The detail records follow in the same segment, whichever slice they fall in
+                    AccountOpening opening;
+                    if (opening.decode(&record, segments[seg].count - offset)) {
+                        openings[w].push_back(opening);
+                    } else {
+                        ++skipped[w];
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+
+        // Recreate the accounts in id order, so the records that follow find them
+        std::vector<AccountOpening> opened;
+        for (std::vector<AccountOpening>& slice : openings) {
+            opened.insert(opened.end(), slice.begin(), slice.end());
+        }
+        std::sort(opened.begin(), opened.end(),
+                  [](const AccountOpening& a, const AccountOpening& b) { return a.id < b.id; });
+        for (const AccountOpening& opening : opened) {
+            if (open_account(opening)) {
+                ++stats.opened;
+            } else {
+                ++stats.skipped;
+            }
+        }
+
+        std::size_t account_count = store.size();
+        for (unsigned w = 0; w < workers; ++w) {
+            threads.emplace_back([&, w] {
+                // Phase 2: scan the whole journal and apply the records of the accounts owned by w.
+                // A record is counted only by the owner of its account.
+                auto owns = [&](AccountId account) { return (account >> 3) % workers == w; };
+                for (const Segment& segment : segments) {
+                    for (std::size_t i = 0; i < segment.count; ++i) {
+                        const JournalRecord& record = segment.records[i];
+                        if (record.lsn <= after_lsn ||
+                            record.type == static_cast<std::uint8_t>(TransactionType::Open) ||
+                            record.type == static_cast<std::uint8_t>(TransactionType::OpenDetail)) {
+                            continue;  // In the snapshot, or opened with its balance above
+                        }
+                        std::int64_t cents;
+                        bool is_transfer = record.type == static_cast<std::uint8_t>(TransactionType::Transfer);
+                        if (record.type == static_cast<std::uint8_t>(TransactionType::Deposit) ||
+                            record.type == static_cast<std::uint8_t>(TransactionType::Interest)) {
+                            cents = record.amount;
+                        } else if (record.type == static_cast<std::uint8_t>(TransactionType::Withdrawal) ||
+                                   is_transfer) {
+                            cents = -record.amount;
+                        } else {
+                            skipped[w] += owns(record.account);
+                            continue;
+                        }
+                        if (record.account >= account_count ||
+                            (is_transfer && record.counterparty >= account_count)) {
+                            skipped[w] += owns(record.account);
+                            continue;
+                        }
+                        if (owns(record.account)) {
+                            store.adjust(record.account, cents);
+                            ++applied[w];
+                        }
+                        if (is_transfer && owns(record.counterparty)) {
+                            store.adjust(record.counterparty, record.amount);
+                        }
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        for (const Segment& segment : segments) {
+            if (segment.base != MAP_FAILED) {
+                ::munmap(segment.base, segment.bytes);
+            }
+        }
+        for (unsigned w = 0; w < workers; ++w) {
+            stats.records += applied[w];
+            stats.skipped += skipped[w];
+            stats.last_lsn = std::max(stats.last_lsn, last_lsn[w]);
+        }
+        stats.last_lsn = std::max(stats.last_lsn, after_lsn);
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return stats;
+    }
+};
+
+// HistoryArchiver Class: Background thread that builds the transaction history from the
+// journal. The journal hands over each batch once it is on disk, so transactions only
+// pay for queueing their journal record; this thread appends the records to the history
+// store in journal order, and the balances they carry make every block's opening balance
+// exact. After a restart the history files are loaded and the journal records written
+// since they were last persisted are appended again.
+class HistoryArchiver {
+private:
+    HistoryStore& store;                  // Private member to store the history to append to
+    std::mutex mutex;                     // Guards queue, applied_lsn, busy and stopping
+    std::mutex apply_mutex;               // Held while appending to or persisting the store
+    std::condition_variable work_ready;   // Signalled when records are queued
+    std::condition_variable caught_up;    // Signalled after each batch is appended
+    std::vector<JournalRecord> queue;     // Records handed over and not yet appended
+    std::uint64_t applied_lsn = 0;        // Highest journal record appended to the store
+    bool busy = false;                    // Set while a batch is being appended
+    bool stopping = false;                // Set when the thread should exit
+    std::thread worker;                   // Background thread
+
+    // Method to append one journal record to the history of the accounts it changed
+    void apply(const JournalRecord& record) {
+        auto type = static_cast<TransactionType>(record.type);
+        switch (type) {
+        case TransactionType::Deposit:
+        case TransactionType::Interest:
+            store.append(record.account, type, record.time_us, record.amount, record.balance);
+            break;
+        case TransactionType::Withdrawal:
+            store.append(record.account, type, record.time_us, -record.amount, record.balance);
+            break;
+        case TransactionType::Transfer:
+            store.append(record.account, type, record.time_us, -record.amount, record.balance);
+            store.append(record.counterparty, type, record.time_us, record.amount, record.counterparty_balance);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Method run by the background thread
+    void run() {
+        std::vector<JournalRecord> batch;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_ready.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                break;  // Stopping and nothing left to append
+            }
+            batch.swap(queue);
+            busy = true;
+            lock.unlock();
+            std::unique_lock<std::mutex> applying(apply_mutex);
+            for (const JournalRecord& record : batch) {
+                apply(record);
+            }
+            lock.lock();
+            applied_lsn = batch.back().lsn;  // Published before persist() can see the store
+            busy = false;
+            applying.unlock();
+            batch.clear();
+            caught_up.notify_all();
+        }
+    }
+
+public:
+    // Constructor to initialize the archiver
+    explicit HistoryArchiver(HistoryStore& history) : store(history) {}
+
+    ~HistoryArchiver() {
+        stop();
+    }
+
+    // Method to load the history kept in a journal directory, append the journal records
+    // written since it was last persisted, and start the thread. Call before any traffic.
+    bool start(const std::string& directory) {
+        stop();
+        if (!store.open(directory)) {
+            return false;
+        }
+        applied_lsn = store.persisted();
+        JournalReplayer::for_each_record(directory, applied_lsn, [this](const JournalRecord& record) {
+            apply(record);
+            applied_lsn = record.lsn;
+        });
+        stopping = false;
+        worker = std::thread(&HistoryArchiver::run, this);
+        return true;
+    }
+
+    // Method to append the rest of the queue and stop the thread
+    void stop() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_one();
+        worker.join();
+    }
+
+    // Method to queue a batch of records that are on disk, called by the journal flusher
+    void feed(const JournalRecord* records, std::size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.insert(queue.end(), records, records + count);
+        work_ready.notify_one();
+    }
+
+    // Method to append every record handed over so far, then make the history durable up
+    // to there. Journal records already on disk when this is called are no longer needed
+    // to rebuild the history once it returns true.
+    bool persist() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            caught_up.wait(lock, [this] { return queue.empty() && !busy; });
+        }
+        std::lock_guard<std::mutex> applying(apply_mutex);
+        std::uint64_t covered;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            covered = applied_lsn;
+        }
+        return store.persist(covered);
+    }
+};
+
+// InterestRates Struct: Daily interest rate of each product as a fraction of the balance in
+// 32.32 fixed point, so a day's interest is (balance * rate) >> 32 cents, rounded to
+// nearest. Rates must stay below 2^32 (100% a day), which keeps every partial product
+// of the kernels within 64 bits.
+struct InterestRates {
+    std::array<std::uint64_t, 256> daily{};  // Daily rate per product
+
+    // Method to set a product's rate from a yearly percentage, compounded daily
+    void set_annual_percent(std::uint8_t product, double percent) {
+        double rate = std::pow(1.0 + percent / 100.0, 1.0 / 365.0) - 1.0;
+        daily[product] = rate <= 0 ? 0 : static_cast<std::uint64_t>(std::min(rate, 0.99) * 4294967296.0 + 0.5);
+    }
+};
+
+// Function to compute a day's interest on balances[0..n) into interest[0..n), one account
+// at a time. Negative balances earn nothing.
+void accrue_interest_scalar(const std::int64_t* balances, const std::uint8_t* products, const std::uint64_t* rates,
+                            std::int64_t* interest, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+        std::uint64_t balance = balances[i] > 0 ? static_cast<std::uint64_t>(balances[i]) : 0;
+        std::uint64_t rate = rates[products[i]];
+        std::uint64_t low = (balance & 0xffffffffu) * rate;
+        interest[i] = static_cast<std::int64_t>((balance >> 32) * rate + (low >> 32) + ((low >> 31) & 1));
+    }
+}
+
+// Function to compute a day's interest four accounts at a time. The 64-bit balance is
+// split into 32-bit halves so each product is a 32x32->64 bit multiply; rates are
+// gathered by product index.
+__attribute__((target("avx2"))) void accrue_interest_avx2(const std::int64_t* balances, const std::uint8_t* products,
+                                                          const std::uint64_t* rates, std::int64_t* interest,
+                                                          std::size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi64x(1);
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        std::int32_t packed;
+        std::memcpy(&packed, products + i, sizeof(packed));
+        __m256i product = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+        __m256i rate = _mm256_i64gather_epi64(reinterpret_cast<const long long*>(rates), product, 8);
+        __m256i balance = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(balances + i));
+        balance = _mm256_and_si256(balance, _mm256_cmpgt_epi64(balance, zero));
+        __m256i low = _mm256_mul_epu32(balance, rate);
+        __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(balance, 32), rate);
+        __m256i result = _mm256_add_epi64(high, _mm256_srli_epi64(low, 32));
+        result = _mm256_add_epi64(result, _mm256_and_si256(_mm256_srli_epi64(low, 31), one));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(interest + i), result);
+    }
+    accrue_interest_scalar(balances + i, products + i, rates, interest + i, n - i);
+}
+
+// Function to compute a day's interest eight accounts at a time with AVX-512
+__attribute__((target("avx512f"))) void accrue_interest_avx512(const std::int64_t* balances,
+                                                               const std::uint8_t* products,
+                                                               const std::uint64_t* rates, std::int64_t* interest,
+                                                               std::size_t n) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one = _mm512_set1_epi64(1);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // Masked forms with every lane enabled give the same results as the plain
+        // intrinsics without reading an undefined source register
+        const __mmask8 all = 0xff;
+        __m512i product =
+            _mm512_maskz_cvtepu8_epi64(all, _mm_loadl_epi64(reinterpret_cast<const __m128i*>(products + i)));
+        __m512i rate = _mm512_mask_i64gather_epi64(zero, all, product, rates, 8);
+        __m512i balance = _mm512_loadu_si512(balances + i);
+        balance = _mm512_maskz_mov_epi64(_mm512_cmpgt_epi64_mask(balance, zero), balance);
+        __m512i low = _mm512_maskz_mul_epu32(all, balance, rate);
+        __m512i high = _mm512_maskz_mul_epu32(all, _mm512_maskz_srli_epi64(all, balance, 32), rate);
+        __m512i result = _mm512_add_epi64(high, _mm512_maskz_srli_epi64(all, low, 32));
+        result = _mm512_add_epi64(result, _mm512_and_si512(_mm512_maskz_srli_epi64(all, low, 31), one));
+        _mm512_storeu_si512(interest + i, result);
+    }
+    accrue_interest_scalar(balances + i, products + i, rates, interest + i, n - i);
+}
+
+// InterestKernel Struct: The interest kernel chosen for this CPU
+struct InterestKernel {
+    const char* name;  // Instruction set the kernel uses
+    void (*run)(const std::int64_t*, const std::uint8_t*, const std::uint64_t*, std::int64_t*, std::size_t);
+
+    // Method to pick the widest kernel the CPU supports
+    static InterestKernel detect() {
+        if (__builtin_cpu_supports("avx512f")) {
+            return InterestKernel{"avx512", accrue_interest_avx512};
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return InterestKernel{"avx2", accrue_interest_avx2};
+        }
+        return InterestKernel{"scalar", accrue_interest_scalar};
+    }
+};
+
+// InterestStats Struct: Outcome and cost of one interest run
+struct InterestStats {
+    std::uint64_t accounts = 0;     // Accounts in the snapshot the interest was computed on
+    std::uint64_t credited = 0;     // Accounts that received interest
+    std::uint64_t failed = 0;       // Credits refused because the balance would overflow
+    Money total;                    // Interest credited in total
+    const char* kernel = "";        // Kernel used for the computation
+    double pause_seconds = 0;       // Time transactions were held back while copying balances
+    double compute_seconds = 0;     // Time spent in the kernel
+    double seconds = 0;             // Total time including crediting
+    double accounts_per_second = 0; // Kernel throughput
+};
+
+// ReconcileShard Struct: Money movements of one range of accounts over a reconciliation
+// period. Sums are 128-bit so that no total can overflow however large the ledger.
+struct ReconcileShard {
+    static constexpr std::size_t shard_bits = 16;  // Accounts per shard, one balance column chunk
+
+    __int128 opening = 0;        // Balances the period starts from, and those of accounts opened since
+    __int128 deposits = 0;       // Journaled deposits
+    __int128 withdrawals = 0;    // Journaled withdrawals
+    __int128 interest = 0;       // Journaled interest credits
+    __int128 transfers_in = 0;   // Journaled transfers into the shard
+    __int128 transfers_out = 0;  // Journaled transfers out of the shard
+    __int128 closing = 0;        // Live balances at the reconciliation cut
+
+    // Method to get the closing total the opening total and the movements imply
+    __int128 expected() const {
+        return opening + deposits - withdrawals + interest + transfers_in - transfers_out;
+    }
+
+    // Method to get how far the live balances are off from the expected total
+    __int128 discrepancy() const {
+        return closing - expected();
+    }
+
+    // Method to add another shard's sums to this one
+    void merge(const ReconcileShard& other) {
+        opening += other.opening;
+        deposits += other.deposits;
+        withdrawals += other.withdrawals;
+        interest += other.interest;
+        transfers_in += other.transfers_in;
+        transfers_out += other.transfers_out;
+        closing += other.closing;
+    }
+};
+
+// ReconcileReport Struct: Outcome of an end-of-day reconciliation
+struct ReconcileReport {
+    bool ok = false;                     // Whether the snapshot and journal could be read
+    std::uint64_t accounts = 0;          // Accounts at the cut
+    std::uint64_t snapshot_accounts = 0; // Accounts in the opening snapshot
+    std::uint64_t cut_lsn = 0;           // Last journal record before the cut
+    std::uint64_t records = 0;           // Journal records counted
+    std::uint64_t unknown = 0;           // Records naming an account or type that does not exist
+    std::size_t segments = 0;            // Journal segments read
+    unsigned workers = 0;                // Threads used
+    std::vector<ReconcileShard> shards;  // Sums per shard of 2^ReconcileShard::shard_bits accounts
+    ReconcileShard totals;               // Sums over the whole ledger
+    double pause_seconds = 0;            // Time transactions were held back while summing balances
+    double seconds = 0;                  // Total time
+
+    // Method to test whether every shard balances
+    bool balanced() const {
+        return ok && std::all_of(shards.begin(), shards.end(),
+                                 [](const ReconcileShard& shard) { return shard.discrepancy() == 0; });
+    }
+};
+
+using TerminalId = std::uint32_t;  // Number of the terminal a PIN is entered at
+
+// AuthStatus Enum: Outcome of a PIN check
+enum class AuthStatus : std::uint8_t {
+    Success,
+    InvalidCredentials,  // Unknown account number or wrong PIN
+    AccountLocked,       // Too many failed attempts on the account in the current window
+    TerminalLocked,      // Too many failed attempts at the terminal in the current window
+};
+
+// LockoutPolicy Struct: How many failed PIN attempts lock an account or a terminal
+struct LockoutPolicy {
+    std::chrono::seconds window{15 * 60};  // Length of a counting window; a lockout lasts until it ends
+    std::uint32_t account_limit = 3;       // Failures that lock an account
+    std::uint32_t terminal_limit = 20;     // Failures that lock a terminal
+    std::uint32_t peer_limit = 200;        // Failures that lock every terminal of one peer address
+};
+
+// TerminalCounters Struct: The failed PIN counters an attempt is checked against, as
+// FailureWindow words owned by whoever serves the terminal. Words are only touched with
+// atomic operations, so several threads may share them.
+struct TerminalCounters {
+    std::uint64_t* terminal = nullptr;  // Failures at the terminal itself, up to terminal_limit
+    std::uint64_t* peer = nullptr;      // Failures at every terminal of its peer address, up to peer_limit; optional
+};
+
+// PinAttempt Struct: One PIN attempt in a batch passed to ATM::verify_pins
+struct PinAttempt {
+    Account account;  // Account the PIN is entered for; an empty handle never matches
+    PinCode pin;      // Entered PIN
+    bool valid;       // Set by verify_pins
+};
+
+// TxRequest Struct: One transaction in a batch passed to ATM::execute_batch
+struct TxRequest {
+    AccountId account;         // Account to run the transaction on
+    TransactionType type;      // Kind of transaction
+    Money amount;              // Transaction amount
+    TransactionResult result;  // Set by execute_batch
+};
+
+// RequestQueue Class: Bounded lock-free multi-producer queue of pointers (Vyukov-style
+// ring). Each slot carries a sequence number that tells producers and the consumer
+// whether it is free or filled, so pushes from many terminals only contend on the tail
+// counter and never take a lock.
+template <typename T>
+class RequestQueue {
+private:
+    struct alignas(64) Slot {
+        std::atomic<std::size_t> sequence;  // Ticket of the push or pop this slot is waiting for
+        T* value;                           // Queued pointer
+    };
+
+    std::unique_ptr<Slot[]> slots;                 // Private member to store the ring
+    std::size_t mask;                              // Private member to store capacity - 1
+    alignas(64) std::atomic<std::size_t> tail{0};  // Private member to store next push ticket
+    alignas(64) std::size_t head = 0;              // Private member to store next pop ticket, consumer only
+
+public:
+    // Constructor to create a queue with a power-of-two capacity
+    explicit RequestQueue(std::size_t capacity) : slots(new Slot[capacity]), mask(capacity - 1) {
+        for (std::size_t i = 0; i < capacity; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Method to push a pointer, returns false if the queue is full
+    bool push(T* value) {
+        std::size_t ticket = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[ticket & mask];
+            std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == ticket) {
+                if (tail.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                    slot.value = value;
+                    slot.sequence.store(ticket + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (sequence < ticket) {
+                return false;
+            } else {
+                ticket = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Method to pop a pointer on the consumer thread, returns nullptr if the queue is empty
+    T* pop() {
+        Slot& slot = slots[head & mask];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+            return nullptr;
+        }
+        T* value = slot.value;
+        slot.sequence.store(head + mask + 1, std::memory_order_release);
+        ++head;
+        return value;
+    }
+};
+
+// LedgerRequest Struct: One operation sent to the partition that owns an account
+struct LedgerRequest {
+    enum class Kind : std::uint8_t { Deposit, Withdrawal, Balance };
+
+    Kind kind;                          // Operation to run
+    AccountId account;                  // Account to run it on
+    std::int64_t amount;                // Amount in cents for deposits and withdrawals
+    bool success = false;               // Set by the owner
+    std::int64_t balance = 0;           // Balance after the operation, set by the owner
+    std::atomic<bool> done{false};      // Set by the owner once the fields above are final; the
+                                        // owner does not touch the request after setting it
+};
+
+// PartitionedLedger Class: Thread-per-core execution mode. Every account belongs to
+// exactly one partition, and each partition has a worker thread pinned to its own core
+// that holds its accounts' balances in a plain array. Terminals send deposits,
+// withdrawals and balance requests to the owning worker over a lock-free queue and wait
+// for the reply; since only the owner touches a balance, no atomics or locks are needed
+// on the accounts themselves. Accounts are dealt out in groups of eight so that no two
+// partitions write to the same cache line.
+class PartitionedLedger {
+private:
+    struct Partition {
+        RequestQueue<LedgerRequest> inbox{4096};  // Requests waiting for this partition
+        std::vector<std::int64_t> balances;       // Balances of the owned accounts
+        std::vector<std::int64_t> opening;        // Balances when the ledger started
+        std::atomic<std::uint32_t> completed{0};  // Requests answered, what waiting callers sleep on
+        std::thread worker;                       // Owning thread
+    };
+
+    AccountStore& store;                       // Private member to store the ledger the balances came from
+    std::size_t account_count;                 // Private member to store the number of accounts taken over
+    std::vector<std::unique_ptr<Partition>> partitions;  // Private member to store the partitions
+    std::atomic<bool> stopping{false};         // Private member to stop the workers
+
+    // Method to get the partition that owns an account
+    std::size_t owner(AccountId id) const {
+        return (id >> 3) % partitions.size();
+    }
+
+    // Method to get an account's position in its owner's balance array
+    std::size_t slot(AccountId id) const {
+        return ((id >> 3) / partitions.size()) * 8 + (id & 7);
+    }
+
+    // Method run by each partition's worker thread
+    void run(Partition& partition) {
+        unsigned idle = 0;
+        while (true) {
+            LedgerRequest* request = partition.inbox.pop();
+            if (!request) {
+                if (stopping.load(std::memory_order_acquire)) {
+                    return;
+                }
+                // Poll hard while busy, back off when the partition goes quiet
+                if (++idle > 1024) {
+                    std::this_thread::yield();
+                }
+                if (idle > 65536) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+                continue;
+            }
+            idle = 0;
+            std::int64_t& balance = partition.balances[slot(request->account)];
+            switch (request->kind) {
+            case LedgerRequest::Kind::Deposit:
+                request->success = request->amount > 0 && request->amount <= Money::max().to_cents() - balance;
+                if (request->success) {
+                    balance += request->amount;
+                }
+                break;
+            case LedgerRequest::Kind::Withdrawal:
+                request->success = request->amount > 0 && request->amount <= balance;
+                if (request->success) {
+                    balance -= request->amount;
+                }
+                break;
+            case LedgerRequest::Kind::Balance:
+                request->success = true;
+                break;
+            }
+            request->balance = balance;
+            // The caller may return as soon as done is set, so wake it through the
+            // partition's counter rather than through the request
+            request->done.store(true, std::memory_order_release);
+            partition.completed.fetch_add(1, std::memory_order_release);
+            partition.completed.notify_all();
+        }
+    }
+
+    // Method to send a request to the owner and wait for the reply. A caller that has to
+    // sleep waits for the partition's completed counter to move past the value it read
+    // before checking its own request, so a reply in between is never missed.
+    void submit(LedgerRequest& request) {
+        Partition& partition = *partitions[owner(request.account)];
+        while (!partition.inbox.push(&request)) {
+            std::this_thread::yield();  // Owner is saturated, wait for room
+        }
+        for (unsigned spins = 0; spins < 256; ++spins) {
+            if (request.done.load(std::memory_order_acquire)) {
+                return;
+            }
+        }
+        while (true) {
+            std::uint32_t seen = partition.completed.load(std::memory_order_acquire);
+            if (request.done.load(std::memory_order_acquire)) {
+                return;
+            }
+            partition.completed.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    // Method to run one operation on an account
+    LedgerRequest& call(LedgerRequest& request, LedgerRequest::Kind kind, AccountId account, Money amount) {
+        request.kind = kind;
+        request.account = account;
+        request.amount = amount.to_cents();
+        submit(request);
+        return request;
+    }
+
+public:
+    // Constructor to take over the balances of every account in the store and start one
+    // worker per partition. Nothing else may change the store's balances until the ledger
+    // is destroyed.
+    PartitionedLedger(AccountStore& store, unsigned partition_count) : store(store), account_count(store.size()) {
+        partition_count = std::max(1u, partition_count);
+        for (unsigned p = 0; p < partition_count; ++p) {
+            partitions.push_back(std::make_unique<Partition>());
+        }
+        std::size_t accounts = account_count;
+        for (std::size_t p = 0; p < partition_count; ++p) {
+            std::size_t groups = ((accounts + 7) / 8 + partition_count - 1 - p) / partition_count;
+            partitions[p]->balances.assign(groups * 8, 0);
+        }
+        for (AccountId id = 0; id < accounts; ++id) {
+            partitions[owner(id)]->balances[slot(id)] = store.balance(id).to_cents();
+        }
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned p = 0; p < partition_count; ++p) {
+            Partition& partition = *partitions[p];
+            partition.opening = partition.balances;
+            partition.worker = std::thread(&PartitionedLedger::run, this, std::ref(partition));
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(p % cores, &cpus);
+            ::pthread_setaffinity_np(partition.worker.native_handle(), sizeof(cpus), &cpus);
+        }
+    }
+
+    // Destructor to stop the workers and hand the final balances back to the store
+    ~PartitionedLedger() {
+        stopping.store(true, std::memory_order_release);
+        for (auto& partition : partitions) {
+            partition->worker.join();
+        }
+        for (AccountId id = 0; id < account_count; ++id) {
+            const Partition& partition = *partitions[owner(id)];
+            store.adjust(id, partition.balances[slot(id)] - partition.opening[slot(id)]);
+        }
+    }
+
+    // Method to deposit amount; fails for accounts the ledger did not take over
+    bool deposit(AccountId account, Money amount) {
+        LedgerRequest request;
+        return account < account_count && call(request, LedgerRequest::Kind::Deposit, account, amount).success;
+    }
+
+    // Method to withdraw amount; fails for accounts the ledger did not take over
+    bool withdraw(AccountId account, Money amount) {
+        LedgerRequest request;
+        return account < account_count && call(request, LedgerRequest::Kind::Withdrawal, account, amount).success;
+    }
+
+    // Method to check balance; zero for accounts the ledger did not take over
+    Money check_balance(AccountId account) {
+        LedgerRequest request;
+        return account < account_count
+                   ? Money::from_cents(call(request, LedgerRequest::Kind::Balance, account, Money()).balance)
+                   : Money();
+    }
+};
+
+// CheckpointStats Struct: Outcome and cost of one snapshot
+struct CheckpointStats {
+    bool ok = false;             // Whether the snapshot was written and the journal truncated
+    std::uint64_t accounts = 0;  // Accounts in the snapshot
+    std::uint64_t last_lsn = 0;  // Last journal record covered by the snapshot
+    double pause_seconds = 0;    // Time transactions were held back while forking
+    double seconds = 0;          // Total time to write the snapshot
+};
+
+// ATM Class: Handles ATM interactions and transactions
+class ATM {
+private:
+    MappedFile snapshot_file;  // Private member to store the mapped snapshot, if any
+    AccountStore store;        // Private member to store account data
+    ShardedAccountIndex accounts;  // Private member to store account lookup index
+    Journal* journal = nullptr;  // Private member to store optional transaction journal
+    // Private member to store the balances accounts had before journal replay, when
+    // recover() found no snapshot; they are where the journal's movements start from
+    std::vector<std::int64_t> recovered_opening;
+    HistoryStore archive;        // Private member to store the full history, built from the journal
+    HistoryArchiver archiver{archive};  // Private member to store the thread that builds it
+    std::mutex maintenance_mutex;  // Private member to serialize checkpoints and reconciliations
+    LockoutPolicy lockout;  // Private member to store failed PIN limits
+    // TerminalSlot Struct: Entry of the terminal failure table
+    struct TerminalSlot {
+        std::uint64_t key;       // Terminal id plus one, or 0 while the slot is free
+        std::uint64_t failures;  // FailureWindow word of the terminal
+    };
+    static constexpr std::size_t terminal_slots = 1 << 16;
+    // Private member to store failed PIN attempts of numbered terminals, an open-addressing
+    // table whose slots are claimed with a CAS and never freed, so every terminal id has a
+    // counter of its own
+    std::unique_ptr<TerminalSlot[]> terminal_failures{new TerminalSlot[terminal_slots]()};
+
+    // Method to find or claim the failure word of a numbered terminal. Returns nullptr
+    // once terminal_slots different terminals have been seen.
+    std::uint64_t* terminal_failure_word(TerminalId terminal) {
+        std::uint64_t key = static_cast<std::uint64_t>(terminal) + 1;
+        std::size_t start = static_cast<std::size_t>((key * 0x9e3779b97f4a7c15ull) >> 48);
+        for (std::size_t i = 0; i < terminal_slots; ++i) {
+            TerminalSlot& slot = terminal_failures[(start + i) & (terminal_slots - 1)];
+            std::atomic_ref<std::uint64_t> slot_key(slot.key);
+            std::uint64_t current = slot_key.load(std::memory_order_acquire);
+            if (current == 0 && slot_key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                return &slot.failures;
+            }
+            if (current == key) {
+                return &slot.failures;
+            }
+        }
+        return nullptr;
+    }
+
+    // Method to write the account and index arrays as a snapshot file. This reads the
+    // arrays directly and only makes write() calls, so it is safe in a forked child.
+    bool write_snapshot(int fd, std::uint64_t first_segment, std::uint64_t last_lsn) const {
+        static const char padding[64] = {};
+        std::uint64_t slots = 0;
+        for (std::size_t s = 0; s < accounts.shard_count(); ++s) {
+            slots += accounts.shard(s).slot_count();
+        }
+        SnapshotHeader header{};
+        const BloomFilter& filter = accounts.current_filter();
+        header.set_layout(store.size(), static_cast<std::uint32_t>(accounts.shard_count()), slots,
+                          filter.block_count(), sizeof(AccountKey), sizeof(PinHash), sizeof(SnapshotShard), sizeof(AccountIndex::Slot));
+        header.first_segment = first_segment;
+        header.last_lsn = last_lsn;
+        std::size_t n = static_cast<std::size_t>(header.accounts);
+        std::uint64_t position = 0;
+        // Function to pad the file with zeros up to a section offset
+        auto pad_to = [&](std::uint64_t offset) {
+            bool ok = write_fully(fd, padding, offset - position);
+            position = offset;
+            return ok;
+        };
+        bool ok = write_fully(fd, &header, sizeof(header));
+        position = sizeof(header);
+        ok = ok && pad_to(header.keys_offset) && store.write_keys(fd, n);
+        position += n * sizeof(AccountKey);
+        ok = ok && pad_to(header.pins_offset) && store.write_pins(fd, n);
+        position += n * sizeof(PinHash);
+        ok = ok && pad_to(header.balances_offset) && store.write_balances(fd, n);
+        position += n * sizeof(std::int64_t);
+        ok = ok && pad_to(header.products_offset) && store.write_products(fd, n);
+        position += n * sizeof(std::uint8_t);
+        ok = ok && pad_to(header.shards_offset);
+        for (std::size_t s = 0; ok && s < accounts.shard_count(); ++s) {
+            SnapshotShard entry{accounts.shard(s).slot_count(), accounts.shard(s).size()};
+            ok = write_fully(fd, &entry, sizeof(entry));
+            position += sizeof(entry);
+        }
+        ok = ok && pad_to(header.index_offset);
+        for (std::size_t s = 0; ok && s < accounts.shard_count(); ++s) {
+            ok = write_fully(fd, accounts.shard(s).slot_data(), accounts.shard(s).slot_count() * sizeof(AccountIndex::Slot));
+            position += accounts.shard(s).slot_count() * sizeof(AccountIndex::Slot);
+        }
+        ok = ok && pad_to(header.filter_offset) &&
+             write_fully(fd, filter.data(), filter.block_count() * sizeof(BloomFilter::Block));
+        return ok;
+    }
+
+    // Method to wrap a transaction for Journal::append: runs it and, if it succeeds, fills
+    // in the balances it left behind. Every journaled change runs under the journal stripes
+    // of its accounts, so these are exactly the balances right after the transaction.
+    template <typename F>
+    auto journaled(F&& f) {
+        return [this, &f](JournalRecord& record) {
+            if (!f()) {
+                return false;
+            }
+            record.balance = store.balance(record.account).to_cents();
+            if (record.type == static_cast<std::uint8_t>(TransactionType::Transfer)) {
+                record.counterparty_balance = store.balance(record.counterparty).to_cents();
+            }
+            return true;
+        };
+    }
+
+    // Method to build and run one transaction, queueing its journal record if a journal is
+    // attached. Sets lsn to the record's sequence number, or 0 if nothing was journaled.
+    TransactionResult run_transaction(Account account, TransactionType transaction_type, Money amount,
+                                      std::uint64_t& lsn) {
+        lsn = 0;
+        Transaction transaction = Deposit(account, amount);
+        switch (transaction_type) {
+        case TransactionType::Deposit:
+            break;
+        case TransactionType::Withdrawal:
+            transaction = Withdrawal(account, amount);
+            break;
+        default:
+            return TransactionResult::InvalidType;  // Transfers need a destination, see transfer()
+        }
+
+        bool success;
+        if (journal) {
+            lsn = journal->append(journaled([&] { return execute(transaction); }), transaction_type, account.get_id(), amount);
+            success = lsn != 0;
+        } else {
+            success = execute(transaction);
+        }
+        return success ? TransactionResult::Success : TransactionResult::Failed;
+    }
+
+    // Method to map a snapshot file and check its header against this build's layout
+    bool map_snapshot(const std::string& path, MappedFile& mapped, SnapshotHeader& header) const {
+        if (!mapped.map(path) || mapped.size() < sizeof(SnapshotHeader)) {
+            return false;
+        }
+        std::memcpy(&header, mapped.at(0), sizeof(header));
+        SnapshotHeader expected{};
+        expected.set_layout(header.accounts, header.index_shards, header.index_slots, header.filter_blocks,
+                            sizeof(AccountKey), sizeof(PinHash), sizeof(SnapshotShard), sizeof(AccountIndex::Slot));
+        bool valid = std::memcmp(header.magic, SnapshotHeader::expected_magic, sizeof(header.magic)) == 0 &&
+                     header.version == SnapshotHeader::current_version && header.accounts <= 0xffffffffull &&
+                     header.index_shards == accounts.shard_count() &&
+                     header.keys_offset == expected.keys_offset && header.pins_offset == expected.pins_offset &&
+                     header.balances_offset == expected.balances_offset &&
+                     header.products_offset == expected.products_offset &&
+                     header.shards_offset == expected.shards_offset && header.index_offset == expected.index_offset &&
+                     header.filter_offset == expected.filter_offset && header.filter_blocks != 0 &&
+                     (header.filter_blocks & (header.filter_blocks - 1)) == 0 &&
+                     header.file_size == expected.file_size && header.file_size <= mapped.size();
+        const SnapshotShard* shards = reinterpret_cast<const SnapshotShard*>(mapped.at(header.shards_offset));
+        std::uint64_t slots = 0;
+        std::uint64_t entries = 0;
+        for (std::size_t s = 0; valid && s < header.index_shards; ++s) {
+            valid = (shards[s].slots & (shards[s].slots - 1)) == 0 && shards[s].entries * 4 <= shards[s].slots * 3;
+            slots += shards[s].slots;
+            entries += shards[s].entries;
+        }
+        return valid && slots == header.index_slots && entries == header.accounts;
+    }
+
+public:
+    // Method to reserve index room for a number of accounts
+    void reserve(std::size_t expected) {
+        accounts.reserve(expected);
+    }
+
+    // Method to journal every following transaction before it is acknowledged, and to
+    // keep the full transaction history in the journal directory. Call before any
+    // traffic, after recover(). Returns false if the history files cannot be opened.
+    bool attach_journal(Journal* transaction_journal) {
+        journal = transaction_journal;
+        if (!archiver.start(journal->get_directory())) {
+            return false;
+        }
+        journal->set_listener([this](const JournalRecord* records, std::size_t count) {
+            archiver.feed(records, count);
+        });
+        return true;
+    }
+
+    // Method to test whether the full transaction history is kept, which needs a journal
+    bool keeps_history() const {
+        return archive.is_open();
+    }
+
+    // Method to replace every account with the contents of a snapshot file. The file is
+    // mapped rather than read: the arrays and the index table are used where they lie in
+    // the mapping, so loading costs one mmap() and pages are faulted in as accounts are
+    // touched. Writes go to private copies of the pages and never reach the file.
+    bool load_snapshot(const std::string& path, SnapshotHeader& header) {
+        MappedFile mapped;
+        if (!map_snapshot(path, mapped, header)) {
+            return false;
+        }
+        accounts.clear();
+        store.clear();
+        snapshot_file.swap(mapped);
+        std::size_t n = static_cast<std::size_t>(header.accounts);
+        store.attach(reinterpret_cast<AccountKey*>(snapshot_file.at(header.keys_offset)),
+                     reinterpret_cast<PinHash*>(snapshot_file.at(header.pins_offset)),
+                     reinterpret_cast<std::int64_t*>(snapshot_file.at(header.balances_offset)),
+                     reinterpret_cast<std::uint8_t*>(snapshot_file.at(header.products_offset)), n);
+        const SnapshotShard* shards = reinterpret_cast<const SnapshotShard*>(snapshot_file.at(header.shards_offset));
+        AccountIndex::Slot* table = reinterpret_cast<AccountIndex::Slot*>(snapshot_file.at(header.index_offset));
+        for (std::size_t s = 0; s < header.index_shards; ++s) {
+            accounts.attach(s, table, static_cast<std::size_t>(shards[s].slots),
+                            static_cast<std::size_t>(shards[s].entries));
+            table += shards[s].slots;
+        }
+        accounts.attach_filter(reinterpret_cast<BloomFilter::Block*>(snapshot_file.at(header.filter_offset)),
+                               static_cast<std::size_t>(header.filter_blocks));
+        return true;
+    }
+
+    // Method to get the path of the snapshot kept in a journal directory
+    static std::string snapshot_path(const std::string& journal_directory) {
+        return journal_directory + "/snapshot.bin";
+    }
+
+    // Method to rebuild the ledger from a journal directory, call before any traffic. If
+    // the directory holds a snapshot it replaces the accounts added so far; the journal
+    // records written after the snapshot are then replayed on top, recreating the accounts
+    // opened since.
+    ReplayStats recover(const std::string& journal_directory, unsigned workers = 0) {
+        auto started = std::chrono::steady_clock::now();
+        SnapshotHeader header{};
+        bool loaded = load_snapshot(snapshot_path(journal_directory), header);
+        recovered_opening.clear();
+        if (!loaded) {
+            store.for_each_balance_run(store.size(), [&](AccountId, const std::int64_t* run, std::size_t length) {
+                recovered_opening.insert(recovered_opening.end(), run, run + length);
+            });
+        }
+        // Function to recreate an account opened after the snapshot under its journaled id
+        auto open_account = [this](const AccountOpening& opening) {
+            if (opening.id < store.size()) {
+                return store.key(opening.id) == opening.key;  // Already there
+            }
+            AccountId id;
+            return opening.id == store.size() &&
+                   accounts.add(store, opening.key,
+                                [&] { return store.add(opening.key, opening.pin, Money::from_cents(opening.balance)); },
+                                id);
+        };
+        ReplayStats stats = loaded ? JournalReplayer::replay(journal_directory, store, open_account, workers,
+                                                             header.first_segment, header.last_lsn)
+                                   : JournalReplayer::replay(journal_directory, store, open_account, workers);
+        stats.snapshot = loaded;
+        stats.snapshot_accounts = loaded ? header.accounts : 0;
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return stats;
+    }
+
+    // Method to write a snapshot of the ledger next to the attached journal and delete the
+    // journal segments it covers. The ledger is copied with fork(): the journal is frozen
+    // only while the child is created, and the child writes its copy-on-write view of
+    // the balances while transactions keep running in this process.
+    CheckpointStats checkpoint() {
+        auto started = std::chrono::steady_clock::now();
+        CheckpointStats stats;
+        if (!journal) {
+            return stats;
+        }
+        std::lock_guard<std::mutex> maintenance(maintenance_mutex);
+        const std::string& directory = journal->get_directory();
+        std::string temporary = directory + "/snapshot.tmp";
+        std::uint64_t first_segment = 0;
+        pid_t child = -1;
+        journal->freeze([&](std::uint64_t segment, std::uint64_t last_lsn) {
+            auto frozen = std::chrono::steady_clock::now();
+            first_segment = segment;
+            stats.last_lsn = last_lsn;
+            // Hold off account creation too, so the child sees every array and index
+            // shard in a settled state. Shard locks come before the append lock, the
+            // same order add_account takes them in.
+            accounts.with_all_locked([&] {
+                std::unique_lock<std::mutex> appends = store.lock_appends();
+                stats.accounts = store.size();
+                child = ::fork();
+                if (child == 0) {
+                    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                    bool ok = fd >= 0 && write_snapshot(fd, segment, last_lsn) && ::fsync(fd) == 0;
+                    ::_exit(ok ? 0 : 1);
+                }
+            });
+            stats.pause_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frozen).count();
+        });
+        int status = 0;
+        if (child < 0 || ::waitpid(child, &status, 0) != child || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            ::unlink(temporary.c_str());
+            return stats;
+        }
+        if (::rename(temporary.c_str(), snapshot_path(directory).c_str()) != 0 || !sync_directory(directory)) {
+            return stats;
+        }
+        // The history is built from the journal, so it must be persisted past the cut
+        // before the segments go
+        journal->wait_flushed(stats.last_lsn);
+        if (!archiver.persist()) {
+            return stats;
+        }
+        journal->remove_segments_before(first_segment);
+        stats.ok = true;
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return stats;
+    }
+
+    // Method to check that the live balances equal the balances of the last snapshot plus
+    // the journaled movements since. The balances are summed at a consistent cut with the
+    // journal frozen; the snapshot and the journal records up to the cut are then summed
+    // while transactions keep running. Every reduction splits its array across threads,
+    // each with its own 128-bit per-shard sums that are merged at the end. Accounts the
+    // snapshot does not cover open at the balance they had before recovery replayed the
+    // journal, or at the balance journaled when they were added since.
+    ReconcileReport reconcile(unsigned workers = std::thread::hardware_concurrency()) {
+        auto started = std::chrono::steady_clock::now();
+        ReconcileReport report;
+        if (!journal) {
+            return report;
+        }
+        std::lock_guard<std::mutex> maintenance(maintenance_mutex);
+        workers = std::max(1u, workers);
+        report.workers = workers;
+        constexpr std::size_t shard_bits = ReconcileShard::shard_bits;
+        // Function to run body(w) on each of the workers and wait for all of them
+        auto parallel = [workers](auto&& body) {
+            std::vector<std::thread> threads;
+            for (unsigned w = 0; w < workers; ++w) {
+                threads.emplace_back([&body, w] { body(w); });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+        };
+        std::vector<std::vector<ReconcileShard>> partial(workers);
+
+        // Closing balances, summed chunk by chunk with chunks dealt out to the workers
+        journal->freeze([&](std::uint64_t, std::uint64_t last_lsn) {
+            auto frozen = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> appends = store.lock_appends();
+            report.cut_lsn = last_lsn;
+            report.accounts = store.size();
+            std::size_t shard_count = (report.accounts + (std::size_t(1) << shard_bits) - 1) >> shard_bits;
+            parallel([&](unsigned w) {
+                partial[w].assign(shard_count, ReconcileShard());
+                store.for_each_balance_run(report.accounts, [&](AccountId first, const std::int64_t* run,
+                                                                std::size_t length) {
+                    if ((first >> shard_bits) % workers == w) {
+                        __int128 sum = 0;
+                        for (std::size_t i = 0; i < length; ++i) {
+                            sum += run[i];
+                        }
+                        partial[w][first >> shard_bits].closing += sum;
+                    }
+                });
+            });
+            report.pause_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frozen).count();
+        });
+        journal->wait_flushed(report.cut_lsn);
+
+        // Opening balances from the snapshot on disk
+        SnapshotHeader header{};
+        MappedFile snapshot;
+        std::string path = snapshot_path(journal->get_directory());
+        if (::access(path.c_str(), F_OK) == 0 && !map_snapshot(path, snapshot, header)) {
+            return report;
+        }
+        report.snapshot_accounts = std::min<std::uint64_t>(header.accounts, report.accounts);
+        const std::int64_t* opening =
+            report.snapshot_accounts > 0 ? reinterpret_cast<const std::int64_t*>(snapshot.at(header.balances_offset))
+                                         : nullptr;
+        // and, past its end, from the balances found at recovery
+        std::size_t recovered_end = std::clamp<std::size_t>(recovered_opening.size(), report.snapshot_accounts,
+                                                            report.accounts);
+        std::size_t recovered_count = recovered_end - report.snapshot_accounts;
+        parallel([&](unsigned w) {
+            // Function to add values[begin..end) to the opening sums of their shards
+            auto sum_opening = [&](const std::int64_t* values, std::size_t begin, std::size_t end) {
+                while (begin < end) {
+                    std::size_t stop = std::min(end, ((begin >> shard_bits) + 1) << shard_bits);
+                    __int128 sum = 0;
+                    for (std::size_t i = begin; i < stop; ++i) {
+                        sum += values[i];
+                    }
+                    partial[w][begin >> shard_bits].opening += sum;
+                    begin = stop;
+                }
+            };
+            sum_opening(opening, report.snapshot_accounts * w / workers, report.snapshot_accounts * (w + 1) / workers);
+            sum_opening(recovered_opening.data(), report.snapshot_accounts + recovered_count * w / workers,
+                        report.snapshot_accounts + recovered_count * (w + 1) / workers);
+        });
+
+        // Journal records after the snapshot, up to the cut
+        std::vector<std::unique_ptr<MappedFile>> segments;
+        std::vector<std::size_t> starts{0};
+        for (std::uint64_t number : Journal::list_segments(journal->get_directory())) {
+            std::string segment_path = Journal::segment_path(journal->get_directory(), number);
+            std::error_code ec;
+            if (number < header.first_segment || std::filesystem::file_size(segment_path, ec) == 0) {
+                continue;
+            }
+            segments.push_back(std::make_unique<MappedFile>());
+            if (!segments.back()->map(segment_path)) {
+                return report;
+            }
+            starts.push_back(starts.back() + segments.back()->size() / sizeof(JournalRecord));
+        }
+        report.segments = segments.size();
+        std::size_t total = starts.back();
+        std::vector<std::uint64_t> counted(workers, 0), unknown(workers, 0);
+        parallel([&](unsigned w) {
+            std::size_t begin = total * w / workers;
+            std::size_t end = total * (w + 1) / workers;
+            std::size_t seg = std::upper_bound(starts.begin(), starts.end(), begin) - starts.begin() - 1;
+            std::vector<ReconcileShard>& shards = partial[w];
+            for (std::size_t i = begin; i < end; ++i) {
+                while (i >= starts[seg + 1]) {
+                    ++seg;
+                }
+                JournalRecord record;
+                std::memcpy(&record, segments[seg]->at((i - starts[seg]) * sizeof(JournalRecord)), sizeof(record));
+                if (record.lsn <= header.last_lsn || record.lsn > report.cut_lsn) {
+                    continue;
+                }
+                auto type = static_cast<TransactionType>(record.type);
+                bool is_transfer = type == TransactionType::Transfer;
+                if (record.account >= report.accounts || (is_transfer && record.counterparty >= report.accounts) ||
+                    record.type > static_cast<std::uint8_t>(TransactionType::OpenDetail)) {
+                    ++unknown[w];
+                    continue;
+                }
+                ReconcileShard& shard = shards[record.account >> shard_bits];
+                switch (type) {
+                case TransactionType::Deposit:
+                    shard.deposits += record.amount;
+                    break;
+                case TransactionType::Withdrawal:
+                    shard.withdrawals += record.amount;
+                    break;
+                case TransactionType::Interest:
+                    shard.interest += record.amount;
+                    break;
+                case TransactionType::Transfer:
+                    shard.transfers_out += record.amount;
+                    shards[record.counterparty >> shard_bits].transfers_in += record.amount;
+                    break;
+                case TransactionType::Open:
+                    shard.opening += record.amount;
+                    break;
+                case TransactionType::OpenDetail:
+                    continue;  // The rest of an Open record, it moves no money
+                }
+                ++counted[w];
+            }
+        });
+
+        report.shards.assign(partial.empty() ? 0 : partial[0].size(), ReconcileShard());
+        for (unsigned w = 0; w < workers; ++w) {
+            for (std::size_t s = 0; s < report.shards.size(); ++s) {
+                report.shards[s].merge(partial[w][s]);
+            }
+            report.records += counted[w];
+            report.unknown += unknown[w];
+        }
+        for (const ReconcileShard& shard : report.shards) {
+            report.totals.merge(shard);
+        }
+        report.ok = true;
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return report;
+    }
+
+    // Method to credit a day's interest to every account. Balances and products are copied
+    // at a consistent cut (with a journal attached, the journal is frozen for the copy, so
+    // no transaction is half-applied in it); the interest is then computed on the copy by
+    // the vectorized kernel on all cores while transactions keep running, and credited to
+    // the live balances as journaled Interest transactions.
+    InterestStats accrue_interest(const InterestRates& rates, unsigned workers = std::thread::hardware_concurrency()) {
+        auto started = std::chrono::steady_clock::now();
+        InterestStats stats;
+        InterestKernel kernel = InterestKernel::detect();
+        stats.kernel = kernel.name;
+        std::vector<std::int64_t> balances;
+        std::vector<std::uint8_t> products;
+        auto copy = [&] {
+            auto frozen = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> appends = store.lock_appends();
+            balances.resize(store.size());
+            products.resize(store.size());
+            store.copy_balances(balances.data(), products.data(), balances.size());
+            stats.pause_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frozen).count();
+        };
+        if (journal) {
+            journal->freeze([&](std::uint64_t, std::uint64_t) { copy(); });
+        } else {
+            copy();
+        }
+        std::size_t n = balances.size();
+        stats.accounts = n;
+
+        auto computing = std::chrono::steady_clock::now();
+        std::vector<std::int64_t> interest(n);
+        workers = static_cast<unsigned>(std::clamp<std::size_t>(workers, 1, std::max<std::size_t>(n / 65536, 1)));
+        std::vector<std::thread> threads;
+        for (unsigned w = 0; w < workers; ++w) {
+            threads.emplace_back([&, w] {
+                std::size_t begin = n * w / workers & ~std::size_t(63);
+                std::size_t end = w + 1 == workers ? n : n * (w + 1) / workers & ~std::size_t(63);
+                kernel.run(balances.data() + begin, products.data() + begin, rates.daily.data(),
+                           interest.data() + begin, end - begin);
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        stats.compute_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - computing).count();
+        stats.accounts_per_second = stats.compute_seconds > 0 ? n / stats.compute_seconds : 0;
+
+        std::uint64_t last_lsn = 0;
+        std::int64_t total = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (interest[i] == 0) {
+                continue;
+            }
+            AccountId id = static_cast<AccountId>(i);
+            Money amount = Money::from_cents(interest[i]);
+            bool success;
+            if (journal) {
+                std::uint64_t lsn =
+                    journal->append(journaled([&] { return store.accrue(id, amount); }), TransactionType::Interest, id,
+                                    amount);
+                last_lsn = lsn != 0 ? lsn : last_lsn;
+                success = lsn != 0;
+            } else {
+                success = store.accrue(id, amount);
+            }
+            if (success) {
+                ++stats.credited;
+                total += interest[i];
+            } else {
+                ++stats.failed;
+            }
+        }
+        if (last_lsn != 0) {
+            journal->wait_durable(last_lsn);
+        }
+        stats.total = Money::from_cents(total);
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return stats;
+    }
+
+    // Method to move an account to another product, which decides its interest rate
+    void set_product(Account account, std::uint8_t product) {
+        store.set_product(account.get_id(), product);
+    }
+
+    // Method to add account to ATM, returns an empty handle if the account number or
+    // PIN is malformed or the account number is already in use
+    Account add_account(const std::string& account_number, const std::string& pin, Money balance = Money()) {
+        AccountKey key;
+        PinCode code;
+        AccountId id;
+        if (!AccountKey::from_string(account_number, key) || !PinCode::from_string(pin, code)) {
+            return Account();
+        }
+        PinHash hash = PinHash::make(code);  // Hashed before any lock is taken
+        auto create = [&] { return accounts.add(store, key, [&] { return store.add(key, hash, balance); }, id); };
+        if (!journal) {
+            return create() ? Account(&store, id) : Account();
+        }
+        // With a journal, the account is added with the journal locked and journaled in
+        // full, so a reconciliation cut sees both or neither and recovery can recreate it
+        std::uint64_t lsn = journal->append_group<AccountOpening::opening_records>([&](JournalRecord* records) {
+            if (!create()) {
+                return false;
+            }
+            AccountOpening opening;
+            opening.id = id;
+            opening.key = key;
+            opening.pin = hash;
+            opening.balance = balance.to_cents();
+            opening.encode(records);
+            return true;
+        });
+        if (lsn == 0) {
+            return Account();
+        }
+        journal->wait_durable(lsn);
+        return Account(&store, id);
+    }
+
+    // Method to replace the failed PIN limits
+    void set_lockout_policy(const LockoutPolicy& policy) {
+        lockout = policy;
+    }
+
+    // Method to get the failed PIN limits
+    const LockoutPolicy& lockout_policy() const {
+        return lockout;
+    }
+
+    // Method to verify account PIN
+    Account verify_pin(std::string_view account_number, std::string_view pin) {
+        AuthStatus status;
+        return verify_pin(account_number, pin, 0, status);
+    }
+
+    // Method to verify account PIN entered at a numbered terminal, counting failures in
+    // the terminal's own slot of the terminal table
+    Account verify_pin(std::string_view account_number, std::string_view pin, TerminalId terminal,
+                       AuthStatus& status) {
+        std::uint64_t* failures = terminal_failure_word(terminal);
+        if (failures == nullptr) {
+            status = AuthStatus::TerminalLocked;  // Table full: fail closed rather than share a counter
+            return Account();
+        }
+        return verify_pin(account_number, pin, TerminalCounters{failures, nullptr}, status);
+    }
+
+    // Method to verify account PIN entered at a terminal, counting failures against the
+    // account, the terminal and, if given, the terminal's peer address. Each attempt is
+    // counted as a failure before its PIN is checked and taken back if it succeeds, so
+    // concurrent attempts cannot all slip in under the limit. Once any counter has reached
+    // its limit in the current window, the PIN is not even checked until the window ends.
+    // Counters are single atomic words, so a storm of failures takes no lock and allocates
+    // nothing.
+    Account verify_pin(std::string_view account_number, std::string_view pin, const TerminalCounters& counters,
+                       AuthStatus& status) {
+        std::uint64_t window = FailureWindow::current(lockout.window);
+        std::atomic_ref<std::uint64_t> terminal_word(*counters.terminal);
+        std::uint64_t terminal_reserved = FailureWindow::reserve(terminal_word, window, lockout.terminal_limit);
+        if (terminal_reserved == 0) {
+            status = AuthStatus::TerminalLocked;
+            return Account();
+        }
+        std::uint64_t peer_reserved = 0;
+        if (counters.peer) {
+            peer_reserved = FailureWindow::reserve(std::atomic_ref<std::uint64_t>(*counters.peer), window,
+                                                   lockout.peer_limit);
+            if (peer_reserved == 0) {
+                FailureWindow::release(terminal_word, terminal_reserved, false);
+                status = AuthStatus::TerminalLocked;
+                return Account();
+            }
+        }
+        // Function to take back the terminal's and the peer's reserved failures
+        auto release_terminal = [&] {
+            FailureWindow::release(terminal_word, terminal_reserved, false);
+            if (counters.peer) {
+                FailureWindow::release(std::atomic_ref<std::uint64_t>(*counters.peer), peer_reserved, false);
+            }
+        };
+        AccountKey key;
+        PinCode code;
+        AccountId id;
+        if (AccountKey::from_string(account_number, key) && PinCode::from_string(pin, code) &&
+            accounts.find(key, id)) {
+            std::atomic_ref<std::uint64_t> account_word = store.pin_failure_ref(id);
+            std::uint64_t account_reserved = FailureWindow::reserve(account_word, window, lockout.account_limit);
+            if (account_reserved == 0) {
+                release_terminal();
+                status = AuthStatus::AccountLocked;
+                return Account();
+            }
+            if (store.verify_pin(id, code)) {
+                FailureWindow::release(account_word, account_reserved, true);
+                release_terminal();
+                status = AuthStatus::Success;
+                return Account(&store, id);
+            }
+        }
+        status = AuthStatus::InvalidCredentials;
+        return Account();
+    }
+
+    // Method to check a PIN entered at a terminal and open a session for the account. The
+    // session is empty if the check failed; status tells why.
+    Session authenticate(std::string_view account_number, std::string_view pin, TerminalId terminal,
+                         AuthStatus& status) {
+        Account account = verify_pin(account_number, pin, terminal, status);
+        return account ? Session(account.get_id()) : Session();
+    }
+
+    // Method to check a PIN entered at a terminal whose counters the caller owns and open
+    // a session for the account
+    Session authenticate(std::string_view account_number, std::string_view pin, const TerminalCounters& counters,
+                         AuthStatus& status) {
+        Account account = verify_pin(account_number, pin, counters, status);
+        return account ? Session(account.get_id()) : Session();
+    }
+
+    // Method to get the account handle of a session, or an empty handle if the session
+    // does not name an existing account
+    Account account(Session session) {
+        return session && session.account_id() < store.size() ? Account(&store, session.account_id()) : Account();
+    }
+
+    // Method to check a batch of PIN attempts, such as an offline authorization file,
+    // setting each attempt's valid flag. Returns how many attempts matched.
+    std::size_t verify_pins(std::span<PinAttempt> attempts) const {
+        constexpr std::size_t group = 64;
+        AccountId ids[group];
+        PinCode entered[group];
+        bool valid[group];
+        std::size_t index[group];
+        std::size_t matched = 0;
+        std::size_t queued = 0;
+        // Function to hash the queued attempts and record their results
+        auto flush = [&] {
+            if (queued == 0) {
+                return;
+            }
+            store.verify_pins(ids, entered, valid, queued);
+            for (std::size_t q = 0; q < queued; ++q) {
+                attempts[index[q]].valid = valid[q];
+                matched += valid[q];
+            }
+            queued = 0;
+        };
+        for (std::size_t i = 0; i < attempts.size(); ++i) {
+            attempts[i].valid = false;
+            if (!attempts[i].account || attempts[i].pin.length == 0) {
+                continue;
+            }
+            ids[queued] = attempts[i].account.get_id();
+            entered[queued] = attempts[i].pin;
+            index[queued++] = i;
+            if (queued == group) {
+                flush();
+            }
+        }
+        flush();
+        return matched;
+    }
+
+    // Method to select and execute transaction
+    TransactionResult select_transaction(Account account, TransactionType transaction_type, Money amount = Money()) {
+        std::uint64_t lsn;
+        TransactionResult result = run_transaction(account, transaction_type, amount, lsn);
+        if (lsn != 0) {
+            journal->wait_durable(lsn);
+        }
+        return result;
+    }
+
+    // Method to select and execute transaction for a session
+    TransactionResult select_transaction(Session session, TransactionType transaction_type, Money amount = Money()) {
+        Account target = account(session);
+        return target ? select_transaction(target, transaction_type, amount) : TransactionResult::InvalidAccount;
+    }
+
+    // Method to execute a transaction for a session without waiting for the journal. Sets
+    // lsn to the record that must be on disk before the result is acknowledged (see
+    // wait_durable and durable_lsn), or 0 if it may be acknowledged at once.
+    TransactionResult queue_transaction(Session session, TransactionType transaction_type, Money amount,
+                                        std::uint64_t& lsn) {
+        lsn = 0;
+        Account target = account(session);
+        if (!target) {
+            return TransactionResult::InvalidAccount;
+        }
+        TransactionResult result = run_transaction(target, transaction_type, amount, lsn);
+        if (lsn != 0 && !journal->waits_for_disk()) {
+            lsn = 0;
+        }
+        return result;
+    }
+
+    // Method to wait until a result from queue_transaction may be acknowledged
+    void wait_durable(std::uint64_t lsn) {
+        if (lsn != 0) {
+            journal->wait_durable(lsn);
+        }
+    }
+
+    // Method to get the highest journal sequence number on disk; results of
+    // queue_transaction up to it may be acknowledged
+    std::uint64_t durable_lsn() const {
+        return journal ? journal->get_durable_lsn() : 0;
+    }
+
+    // Method to get an eventfd that becomes readable whenever durable_lsn advances, or -1
+    // without a journal
+    int durable_events() const {
+        return journal ? journal->durable_events() : -1;
+    }
+
+    // Method to transfer an amount between two accounts atomically. Both handles must
+    // name accounts of this ATM.
+    TransactionResult transfer(Account from, Account to, Money amount) {
+        if (!from || !to || from.get_id() >= store.size() || to.get_id() >= store.size()) {
+            return TransactionResult::InvalidAccount;
+        }
+        Transaction transaction = Transfer(from, to, amount);
+        bool success;
+        if (journal) {
+            success = journal->commit(journaled([&] { return execute(transaction); }), TransactionType::Transfer,
+                                      from.get_id(), amount, to.get_id());
+        } else {
+            success = execute(transaction);
+        }
+        return success ? TransactionResult::Success : TransactionResult::Failed;
+    }
+
+    // Method to execute many transactions at once, for back-office feeds. Requests are
+    // grouped by account and each account's requests run back to back in their original
+    // order, so its balance stays in cache; groups for different accounts are independent
+    // and large batches spread them across threads. Each request's result is written to
+    // its result field. When journaling, the batch waits for the disk once at the end.
+    void execute_batch(std::span<TxRequest> requests) {
+        // Sort (account, position) pairs packed into one word, which keeps each account's
+        // requests in their original order without an indirect comparison
+        std::vector<std::uint64_t> order(requests.size());
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            order[i] = (std::uint64_t(requests[i].account) << 32) | i;
+        }
+        std::sort(order.begin(), order.end());
+
+        // Function to run the requests in order[begin, end), returning the highest sequence number
+        auto run_range = [this, &requests, &order](std::size_t begin, std::size_t end) {
+            std::uint64_t last_lsn = 0;
+            for (std::size_t i = begin; i < end; ++i) {
+                TxRequest& request = requests[static_cast<std::uint32_t>(order[i])];
+                if (request.account >= store.size()) {
+                    request.result = TransactionResult::InvalidAccount;
+                    continue;
+                }
+                std::uint64_t lsn;
+                request.result = run_transaction(Account(&store, request.account), request.type, request.amount, lsn);
+                last_lsn = std::max(last_lsn, lsn);
+            }
+            return last_lsn;
+        };
+
+        constexpr std::size_t requests_per_thread = 16384;
+        std::size_t workers = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                                    (requests.size() + requests_per_thread - 1) / requests_per_thread);
+        std::vector<std::uint64_t> last_lsn(std::max<std::size_t>(workers, 1), 0);
+        if (workers <= 1) {
+            last_lsn[0] = run_range(0, order.size());
+        } else {
+            // Split at group boundaries so that each account is handled by one thread
+            std::vector<std::size_t> bounds(workers + 1, order.size());
+            bounds[0] = 0;
+            for (std::size_t w = 1; w < workers; ++w) {
+                std::size_t b = std::max(bounds[w - 1], order.size() * w / workers);
+                while (b > bounds[w - 1] && b < order.size() && (order[b] >> 32) == (order[b - 1] >> 32)) {
+                    ++b;
+                }
+                bounds[w] = b;
+            }
+            std::vector<std::thread> threads;
+            for (std::size_t w = 0; w < workers; ++w) {
+                threads.emplace_back([&, w] { last_lsn[w] = run_range(bounds[w], bounds[w + 1]); });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+        }
+
+        std::uint64_t highest = *std::max_element(last_lsn.begin(), last_lsn.end());
+        if (highest != 0) {
+            journal->wait_durable(highest);
+        }
+    }
+
+    // Method to switch to thread-per-core execution: the returned ledger owns every
+    // balance until it is destroyed, and ATM transaction methods must not be used
+    // meanwhile. Requests sent through it are not journaled, so it cannot be used with a
+    // journal (nor with checkpoints, which need one): their balances would be lost on a
+    // crash and missing from reconciliation. Returns nullptr if a journal is attached.
+    std::unique_ptr<PartitionedLedger> partition(unsigned partitions) {
+        if (journal) {
+            return nullptr;
+        }
+        return std::make_unique<PartitionedLedger>(store, partitions);
+    }
+
+    // Method to look up an account by number without a PIN, for back-office use
+    Account find_account(const std::string& account_number) {
+        AccountKey key;
+        AccountId id;
+        if (AccountKey::from_string(account_number, key) && accounts.find(key, id)) {
+            return Account(&store, id);
+        }
+        return Account();
+    }
+
+    // Method to check account balance
+    Money check_balance(Account account) const {
+        return account.check_balance();
+    }
+
+    // Method to check the balance of a session's account, zero if the session does not
+    // name an existing account
+    Money check_balance(Session session) {
+        Account target = account(session);
+        return target ? target.check_balance() : Money();
+    }
+
+    // Method to fill a mini statement for a session's account; see mini_statement(Account).
+    // Fills nothing if the session does not name an existing account.
+    std::size_t mini_statement(Session session, std::array<StatementLine, HistoryRing::capacity>& lines) {
+        Account target = account(session);
+        return target ? mini_statement(target, lines) : 0;
+    }
+
+    // Method to fill a mini statement with the account's most recent transactions, newest
+    // first; returns how many lines were filled
+    std::size_t mini_statement(Account account, std::array<StatementLine, HistoryRing::capacity>& lines) const {
+        return account.recent_transactions(lines.data(), lines.size());
+    }
+
+    // Method to build the statement of a calendar month in local time, or of the whole year
+    // when month is 0. The history is built from the journal, so a transaction shows up
+    // once its journal batch is on disk, normally within a group window. Returns false if
+    // year or month is out of range.
+    bool statement(Account account, int year, int month, Statement& result) const {
+        if (year < 1970 || year > 9999 || month < 0 || month > 12) {
+            return false;
+        }
+        std::tm start{};
+        start.tm_year = year - 1900;
+        start.tm_mon = month == 0 ? 0 : month - 1;
+        start.tm_mday = 1;
+        start.tm_isdst = -1;
+        std::tm end = start;
+        if (month == 0) {
+            end.tm_year += 1;
+        } else {
+            end.tm_mon += 1;  // mktime normalizes December + 1 into January of the next year
+        }
+        std::int64_t from_us = static_cast<std::int64_t>(std::mktime(&start)) * 1000000;
+        std::int64_t to_us = static_cast<std::int64_t>(std::mktime(&end)) * 1000000;
+        if (!archive.statement(account.get_id(), from_us, to_us, result)) {
+            // No history recorded: the balance has not moved since the account was opened
+            result.opening = account.check_balance();
+            result.closing = result.opening;
+        }
+        return true;
+    }
+
+    // Method to build a monthly or yearly statement for a session's account
+    bool statement(Session session, int year, int month, Statement& result) {
+        Account target = account(session);
+        return target && statement(target, year, month, result);
+    }
+
+    // Method to get the size and accuracy of the filter that rejects unknown account numbers
+    BloomStats account_filter_stats() const {
+        return accounts.filter_stats();
+    }
+
+    // Method to get the bytes of memory used by the full transaction history
+    std::size_t history_bytes() const {
+        return archive.memory_usage();
+    }
+};
+
+// Checkpointer Class: Background thread that snapshots the ledger at a fixed interval
+class Checkpointer {
+private:
+    ATM& atm;                            // Private member to store the ATM to snapshot
+    std::chrono::milliseconds interval;  // Private member to store time between snapshots
+    std::mutex mutex;                    // Guards stopping
+    std::condition_variable wake;        // Signalled to stop early
+    bool stopping = false;               // Set when the thread should exit
+    CheckpointStats last;                // Stats of the most recent snapshot, guarded by mutex
+    std::function<void(const CheckpointStats&)> report;  // Private member to store the callback run after each snapshot
+    std::thread worker;                  // Background snapshot thread
+
+    // Method run by the background thread
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+            lock.unlock();
+            CheckpointStats stats = atm.checkpoint();
+            if (report) {
+                report(stats);
+            }
+            lock.lock();
+            last = stats;
+        }
+    }
+
+public:
+    // Constructor to start taking snapshots, passing the stats of each one to report on
+    // the background thread
+    Checkpointer(ATM& atm, std::chrono::milliseconds interval,
+                 std::function<void(const CheckpointStats&)> report = nullptr)
+        : atm(atm), interval(interval), report(std::move(report)), worker(&Checkpointer::run, this) {}
+
+    ~Checkpointer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    // Method to get stats of the most recent snapshot
+    CheckpointStats last_checkpoint() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return last;
+    }
+};
+
+// Function to append an amount to an output buffer as units and two decimal places,
+// matching operator<< without going through a stream
+void append_money(std::string& out, Money amount) {
+    std::int64_t cents = amount.to_cents();
+    std::uint64_t magnitude = cents < 0 ? 0 - static_cast<std::uint64_t>(cents) : static_cast<std::uint64_t>(cents);
+    char text[32];
+    char* end = text;
+    if (cents < 0) {
+        *end++ = '-';
+    }
+    end = std::to_chars(end, text + sizeof(text), magnitude / 100).ptr;
+    *end++ = '.';
+    *end++ = static_cast<char>('0' + magnitude % 100 / 10);
+    *end++ = static_cast<char>('0' + magnitude % 10);
+    out.append(text, end);
+}
+
+// CommandProcessor Class: Executes the text command protocol for one terminal, one line at
+// a time, appending one result line per command to an output buffer. Commands are
+//   auth <account number> <pin> [terminal]
+//   deposit <amount>
+//   withdraw <amount>
+//   balance
+//   exit
+// and results are "ok ..." or "error <reason>", for example "ok balance 1050.00" or
+// "error invalid_credentials". Blank lines and lines starting with '#' produce no result.
+// A processor is either a numbered terminal, as for a trusted batch script whose auth may
+// name another terminal number, or a connection terminal that counts failed PINs in its
+// own counter plus one shared by its peer address. A connection terminal checks and
+// ignores the terminal word, so a client cannot dodge the lockout by naming a fresh
+// terminal on each attempt.
+// Lines are parsed in place as string_views, so executing a command allocates nothing
+// once the output buffer has grown to its working size.
+class CommandProcessor {
+private:
+    ATM& atm;                               // Private member to store the ATM the commands run against
+    TerminalId terminal = 0;                // Private member to store the numbered terminal failed PINs count against
+    std::uint64_t failures = 0;             // Private member to store a connection terminal's FailureWindow word
+    std::uint64_t* peer_failures = nullptr;  // Private member to store the peer's word, set for connection terminals
+    Session session;                        // Private member to store the session opened by the last auth
+
+    // Method to split the next space-separated word off the front of a line
+    static std::string_view next_word(std::string_view& line) {
+        std::size_t start = line.find_first_not_of(" \t");
+        if (start == std::string_view::npos) {
+            line = std::string_view();
+            return line;
+        }
+        std::size_t end = line.find_first_of(" \t", start);
+        if (end == std::string_view::npos) {
+            end = line.size();
+        }
+        std::string_view word = line.substr(start, end - start);
+        line.remove_prefix(end);
+        return word;
+    }
+
+    // Method to get the protocol name of an authentication failure
+    static const char* to_reason(AuthStatus status) {
+        switch (status) {
+        case AuthStatus::AccountLocked:
+            return "account_locked";
+        case AuthStatus::TerminalLocked:
+            return "terminal_locked";
+        default:
+            return "invalid_credentials";
+        }
+    }
+
+    // Method to get the protocol name of a failed transaction
+    static const char* to_reason(TransactionResult result) {
+        switch (result) {
+        case TransactionResult::Failed:
+            return "declined";
+        case TransactionResult::InvalidAccount:
+            return "invalid_account";
+        default:
+            return "invalid_transaction";
+        }
+    }
+
+    // Method to run a deposit or withdrawal and report the balance after it, setting lsn
+    // to the journal record the report must wait for
+    void transact(TransactionType type, std::string_view word, std::string_view rest, std::string& out,
+                  std::uint64_t& lsn) {
+        Money amount;
+        if (!session) {
+            out += "error not_authenticated\n";
+        } else if (!next_word(rest).empty() || !Money::parse(word, amount)) {
+            out += "error invalid_amount\n";
+        } else if (TransactionResult result = atm.queue_transaction(session, type, amount, lsn);
+                   result != TransactionResult::Success) {
+            out += "error ";
+            out += to_reason(result);
+            out += '\n';
+        } else {
+            out += type == TransactionType::Deposit ? "ok deposit " : "ok withdraw ";
+            append_money(out, atm.check_balance(session));
+            out += '\n';
+        }
+    }
+
+public:
+    // Constructor to start a numbered terminal with no open session
+    CommandProcessor(ATM& atm, TerminalId terminal) : atm(atm), terminal(terminal) {}
+
+    // Constructor to start a connection terminal with no open session, sharing a failure
+    // counter with the other terminals of its peer address
+    CommandProcessor(ATM& atm, std::uint64_t& peer_failures) : atm(atm), peer_failures(&peer_failures) {}
+
+    // Method to test whether a session is open
+    bool authenticated() const {
+        return static_cast<bool>(session);
+    }
+
+    // Method to execute one command line, without its newline, and append the result to
+    // out once it may be acknowledged. Returns false for lines that are not a command.
+    bool execute(std::string_view line, std::string& out) {
+        std::uint64_t lsn;
+        bool executed = execute(line, out, lsn);
+        atm.wait_durable(lsn);
+        return executed;
+    }
+
+    // Method to execute one command line without waiting for the journal. The result is
+    // appended to out at once, but must not be sent until ATM::durable_lsn reaches lsn;
+    // lsn is 0 if it may be sent immediately.
+    bool execute(std::string_view line, std::string& out, std::uint64_t& lsn) {
+        lsn = 0;
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        std::string_view command = next_word(line);
+        if (command.empty() || command.front() == '#') {
+            return false;
+        }
+        if (command == "auth") {
+            std::string_view number = next_word(line);
+            std::string_view pin = next_word(line);
+            std::string_view terminal_text = next_word(line);
+            TerminalId at = terminal;
+            if (!terminal_text.empty()) {
+                auto [end, error] = std::from_chars(terminal_text.data(), terminal_text.data() + terminal_text.size(), at);
+                if (error != std::errc() || end != terminal_text.data() + terminal_text.size()) {
+                    out += "error invalid_arguments\n";
+                    return true;
+                }
+            }
+            if (pin.empty() || !next_word(line).empty()) {
+                out += "error invalid_arguments\n";
+                return true;
+            }
+            AuthStatus status;
+            session = peer_failures ? atm.authenticate(number, pin, TerminalCounters{&failures, peer_failures}, status)
+                                    : atm.authenticate(number, pin, at, status);
+            if (session) {
+                out += "ok auth\n";
+            } else {
+                out += "error ";
+                out += to_reason(status);
+                out += '\n';
+            }
+        } else if (command == "deposit") {
+            transact(TransactionType::Deposit, next_word(line), line, out, lsn);
+        } else if (command == "withdraw") {
+            transact(TransactionType::Withdrawal, next_word(line), line, out, lsn);
+        } else if (command == "balance") {
+            if (!session) {
+                out += "error not_authenticated\n";
+            } else {
+                out += "ok balance ";
+                append_money(out, atm.check_balance(session));
+                out += '\n';
+            }
+        } else if (command == "exit") {
+            session = Session();
+            out += "ok exit\n";
+        } else {
+            out += "error unknown_command\n";
+        }
+        return true;
+    }
+};
+
+// BatchStats Struct: Outcome and cost of one batch run
+struct BatchStats {
+    bool ok = true;              // Whether all input was read and all results written
+    std::uint64_t commands = 0;  // Commands executed
+    double seconds = 0;          // Total time to run the batch
+};
+
+// Function to run a script of commands from one file descriptor and write the results to
+// another, one result line per command in input order. Input is read in large blocks and
+// cut into lines in place, and results are written in large blocks, so throughput is
+// bound by the commands themselves rather than by stream I/O. Commands do not wait for the
+// journal one by one: each block of results waits once, before it is written, for the
+// newest record it reports, so a block of transactions shares a few group commits.
+BatchStats run_batch(ATM& atm, int input_fd, int output_fd, TerminalId terminal = 0) {
+    constexpr std::size_t block_size = 1 << 20;
+    auto started = std::chrono::steady_clock::now();
+    BatchStats stats;
+    CommandProcessor processor(atm, terminal);
+    std::vector<char> input(block_size);
+    std::string output;
+    output.reserve(block_size + 256);
+    std::size_t filled = 0;
+    bool skipping = false;  // Inside a line too long for the input buffer
+    bool end_of_input = false;
+    std::uint64_t highest_lsn = 0;  // Newest journal record reported in output
+    while (!end_of_input && stats.ok) {
+        ssize_t n = ::read(input_fd, input.data() + filled, input.size() - filled);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            stats.ok = false;
+            break;
+        }
+        end_of_input = n == 0;
+        filled += static_cast<std::size_t>(n);
+        const char* begin = input.data();
+        const char* end = begin + filled;
+        while (begin < end) {
+            const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+            if (newline == nullptr && !end_of_input && (begin != input.data() || filled < input.size())) {
+                break;  // Wait for the rest of the line
+            }
+            const char* line_end = newline ? newline : end;
+            if (newline == nullptr && !end_of_input) {
+                if (!skipping) {
+                    output += "error line_too_long\n";
+                    ++stats.commands;
+                }
+                skipping = true;
+            } else if (skipping) {
+                skipping = false;
+            } else {
+                std::uint64_t lsn;
+                stats.commands += processor.execute(std::string_view(begin, line_end - begin), output, lsn);
+                highest_lsn = std::max(highest_lsn, lsn);
+            }
+            begin = newline ? newline + 1 : end;
+            if (output.size() >= block_size) {
+                atm.wait_durable(highest_lsn);
+                stats.ok = write_fully(output_fd, output.data(), output.size()) && stats.ok;
+                output.clear();
+            }
+        }
+        filled = end - begin;
+        std::memmove(input.data(), begin, filled);
+    }
+    atm.wait_durable(highest_lsn);
+    stats.ok = write_fully(output_fd, output.data(), output.size()) && stats.ok;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return stats;
+}
+
+// ServerStats Struct: Counters of a terminal server run
+struct ServerStats {
+    std::uint64_t connections = 0;       // Connections accepted
+    std::uint64_t peak_connections = 0;  // Most connections open at once
+    std::uint64_t commands = 0;          // Commands executed
+};
+
+// TerminalServer Class: Serves many terminals at once over TCP or a Unix socket. Each
+// connection speaks the batch command protocol and owns its own CommandProcessor, so it
+// has its own session. Every connection is a terminal with its own failed PIN counter,
+// whatever terminal number it sends. As a coarser second limit, the terminals of one peer
+// address (the IP address over TCP, the user id over a Unix socket) share a counter that
+// outlives their connections, so reconnecting does not reset it. One thread runs
+// an epoll event loop over non-blocking sockets; a connection costs a few hundred bytes
+// plus its buffers, so tens of thousands of idle terminals are cheap. The loop never
+// waits for the journal: a result that must be on disk first is held back in its
+// connection's output, and the connection is parked until the journal's durable eventfd
+// reports that durable_lsn has reached it. Other connections, balance checks included,
+// are served meanwhile; within a connection results still go out in command order.
+class TerminalServer {
+private:
+    static constexpr std::size_t max_line = 4096;          // Longest accepted command line
+    static constexpr std::size_t max_pending = 1 << 20;    // Unsent output that pauses reading
+    static constexpr std::uint64_t listen_tag = ~0ull;     // epoll data of the listening socket
+    static constexpr std::uint64_t wake_tag = ~0ull - 1;   // epoll data of the stop event
+    static constexpr std::uint64_t durable_tag = ~0ull - 2;  // epoll data of the journal's durable event
+
+    // Hold Struct: A result in a connection's output that waits for the journal
+    struct Hold {
+        std::size_t start;  // Offset in output where the result begins
+        std::uint64_t lsn;  // Journal record that must be on disk before it is sent
+    };
+
+    // PeerEntry Struct: Failed PINs of every terminal connected from one peer address
+    struct PeerEntry {
+        std::uint64_t failures = 0;      // FailureWindow word shared by the peer's terminals
+        std::uint32_t connections = 0;   // Open connections from the peer
+    };
+
+    // Connection Struct: State of one connected terminal
+    struct Connection {
+        int fd;
+        PeerEntry& peer;
+        CommandProcessor processor;
+        std::string input;         // Bytes received after the last complete line
+        std::string output;        // Results not yet sent
+        std::size_t sent = 0;      // Bytes of output already sent
+        std::vector<Hold> holds;   // Held results in output order, oldest first
+        bool reading = true;       // Whether the socket is polled for input
+        bool closing = false;      // Close once output has been sent
+        bool parked = false;       // Whether the connection is on the parked list
 
-public:
-    // Constructor to initialize account details
-    Account(const std::string& account_number, const std::string& pin, double balance = 0)
-        : account_number(account_number), pin(pin), balance(balance) {}
+        // Method to get how much of output may be sent: everything before the first held result
+        std::size_t sendable() const {
+            return holds.empty() ? output.size() : holds.front().start;
+        }
 
-    // Method to check balance
-    double check_balance() const {
-        return balance;
+        Connection(int fd, ATM& atm, PeerEntry& peer) : fd(fd), peer(peer), processor(atm, peer.failures) {}
+    };
+
+    ATM& atm;                                              // Private member to store the shared ATM
+    int listen_fd = -1;                                    // Private member to store the listening socket
+    int epoll_fd = -1;                                     // Private member to store the event loop
+    int wake_fd = -1;                                      // Private member to store the eventfd that stops the loop
+    int durable_fd = -1;                                   // Private member to store the journal's durable eventfd
+    std::string unix_path;                                 // Private member to store the Unix socket to unlink
+    std::vector<std::unique_ptr<Connection>> connections;  // Private member to store connections by fd
+    std::uint64_t open_connections = 0;                    // Private member to store the number of open connections
+    std::vector<int> parked;                               // Private member to store connections with held results
+    std::vector<int> releasing;                            // Private member to store the parked list being released
+    std::unordered_map<std::string, PeerEntry> peers;      // Private member to store failure counters by peer address
+    std::size_t swept_peers = 0;                           // Private member to store the peer count after the last sweep
+    ServerStats stats;                                     // Private member to store the counters
+
+    // Method to watch a connection for input, output or both
+    void watch(Connection& connection, int operation) {
+        epoll_event event{};
+        event.events = (connection.reading ? std::uint32_t(EPOLLIN) : 0u) |
+                       (connection.sent < connection.sendable() ? std::uint32_t(EPOLLOUT) : 0u);
+        event.data.u64 = static_cast<std::uint64_t>(connection.fd);
+        ::epoll_ctl(epoll_fd, operation, connection.fd, &event);
     }
 
-    // Method to deposit amount
-    bool deposit(double amount) {
-        if (amount > 0) {
-            balance += amount;
-            return true;
+    // Method to close a connection and forget it
+    void close_connection(Connection& connection) {
+        int fd = connection.fd;
+        PeerEntry& peer = connection.peer;
+        ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        connections[fd].reset();
+        --open_connections;
+        --peer.connections;
+    }
+
+    // Method to forget the peers that have no connection and no failures in the current
+    // window. Runs whenever the table has doubled since the last sweep, so its cost is
+    // spread over the connections that grew it.
+    void sweep_peers() {
+        if (peers.size() < 2 * swept_peers + 1024) {
+            return;
         }
-        return false;
+        std::uint64_t window = FailureWindow::current(atm.lockout_policy().window);
+        std::erase_if(peers, [window](const auto& entry) {
+            return entry.second.connections == 0 && FailureWindow::failures(entry.second.failures, window) == 0;
+        });
+        swept_peers = peers.size();
     }
 
-    // Method to withdraw amount
-    bool withdraw(double amount) {
-        if (amount > 0 && amount <= balance) {
-            balance -= amount;
+    // Method to get the address of a connected peer as a table key: the user id of a Unix
+    // socket peer, or the IPv4 or IPv6 address of a TCP peer, whatever its port. Returns
+    // false if the peer cannot be identified.
+    bool peer_address(int fd, std::string& key) const {
+        if (!unix_path.empty()) {
+            ucred credentials{};
+            socklen_t size = sizeof(credentials);
+            if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0) {
+                return false;
+            }
+            key.assign("u").append(reinterpret_cast<const char*>(&credentials.uid), sizeof(credentials.uid));
+            return true;
+        }
+        sockaddr_storage peer{};
+        socklen_t size = sizeof(peer);
+        if (::getpeername(fd, reinterpret_cast<sockaddr*>(&peer), &size) != 0) {
+            return false;
+        }
+        if (peer.ss_family == AF_INET) {
+            const in_addr& address = reinterpret_cast<const sockaddr_in&>(peer).sin_addr;
+            key.assign("4").append(reinterpret_cast<const char*>(&address), sizeof(address));
+            return true;
+        }
+        if (peer.ss_family == AF_INET6) {
+            const in6_addr& address = reinterpret_cast<const sockaddr_in6&>(peer).sin6_addr;
+            if (IN6_IS_ADDR_V4MAPPED(&address)) {
+                key.assign("4").append(reinterpret_cast<const char*>(address.s6_addr) + 12, 4);
+            } else {
+                key.assign("6").append(reinterpret_cast<const char*>(address.s6_addr), sizeof(address.s6_addr));
+            }
             return true;
         }
         return false;
     }
 
-    // Method to verify PIN
-    bool verify_pin(const std::string& entered_pin) const {
-        return pin == entered_pin;
+    // Method to accept every pending connection
+    void accept_connections() {
+        while (true) {
+            int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return;  // EAGAIN, or out of descriptors until a connection closes
+            }
+            std::string address;
+            if (!peer_address(fd, address)) {
+                ::close(fd);
+                continue;
+            }
+            sweep_peers();
+            PeerEntry& peer = peers[address];
+            ++peer.connections;
+            if (unix_path.empty()) {
+                int on = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            if (static_cast<std::size_t>(fd) >= connections.size()) {
+                connections.resize(static_cast<std::size_t>(fd) + 1);
+            }
+            ++stats.connections;
+            connections[fd] = std::make_unique<Connection>(fd, atm, peer);
+            stats.peak_connections = std::max(stats.peak_connections, ++open_connections);
+            watch(*connections[fd], EPOLL_CTL_ADD);
+        }
     }
 
-    // Method to get account number
-    const std::string& get_account_number() const {
-        return account_number;
+    // Method to send as much pending output as the socket takes. Returns false if the
+    // connection failed or has finished and was closed.
+    bool flush(Connection& connection) {
+        std::size_t sendable = connection.sendable();
+        while (connection.sent < sendable) {
+            ssize_t n = ::send(connection.fd, connection.output.data() + connection.sent,
+                               sendable - connection.sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n <= 0) {
+                close_connection(connection);
+                return false;
+            }
+            connection.sent += static_cast<std::size_t>(n);
+        }
+        if (connection.sent == sendable && !connection.holds.empty() && connection.sent > 0) {
+            connection.output.erase(0, connection.sent);  // Keep only the held results
+            for (Hold& hold : connection.holds) {
+                hold.start -= connection.sent;
+            }
+            connection.sent = 0;
+        }
+        if (connection.sent == connection.output.size()) {
+            connection.output.clear();
+            connection.sent = 0;
+            if (connection.closing) {
+                close_connection(connection);
+                return false;
+            }
+        }
+        return true;
     }
-};
-
-// Transaction Abstract Base Class: Represents a generic transaction
-class Transaction {
-protected:
-    Account* account;  // Protected member to store account
-
-public:
-    // Constructor to initialize account
-    Transaction(Account* account) : account(account) {}
-
-    // Pure virtual method to execute transaction
-    virtual bool execute() = 0;
-
-    // Virtual destructor
-    virtual ~Transaction() = default;
-};
-
-// Deposit Class: Represents a deposit transaction
-class Deposit : public Transaction {
-private:
-    double amount;  // Private member to store deposit amount
 
-public:
-    // Constructor to initialize account and deposit amount
-    Deposit(Account* account, double amount) : Transaction(account), amount(amount) {}
+    // Method to turn reading back on for a connection paused until its output was sent
+    static bool resume_reading(Connection& connection) {
+        if (connection.reading || connection.closing || !connection.output.empty()) {
+            return false;
+        }
+        connection.reading = true;
+        return true;
+    }
 
-    // Method to execute deposit transaction
-    bool execute() override {
-        return account->deposit(amount);
+    // Method to execute one command line of a connection, holding its result back if it
+    // must wait for the journal
+    void execute(Connection& connection, std::string_view line) {
+        std::size_t start = connection.output.size();
+        std::uint64_t lsn;
+        stats.commands += connection.processor.execute(line, connection.output, lsn);
+        if (lsn != 0) {
+            connection.holds.push_back(Hold{start, lsn});
+            if (!connection.parked) {
+                connection.parked = true;
+                parked.push_back(connection.fd);
+            }
+        }
     }
-};
 
-// Withdrawal Class: Represents a withdrawal transaction
-class Withdrawal : public Transaction {
-private:
-    double amount;  // Private member to store withdrawal amount
+    // Method to read what a connection has sent and execute every complete line, until
+    // the socket is drained or too much output is waiting to be sent
+    void read_commands(Connection& connection) {
+        char buffer[16384];
+        while (connection.reading) {
+            ssize_t n = ::recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n <= 0) {
+                connection.reading = false;  // Peer finished sending; answer what it sent, then close
+                connection.closing = true;
+                break;
+            }
+            connection.input.append(buffer, static_cast<std::size_t>(n));
+            std::string_view pending(connection.input);
+            std::size_t newline;
+            while ((newline = pending.find('\n')) != std::string_view::npos) {
+                execute(connection, pending.substr(0, newline));
+                pending.remove_prefix(newline + 1);
+            }
+            if (pending.size() > max_line) {
+                connection.output += "error line_too_long\n";
+                connection.reading = false;
+                connection.closing = true;
+                break;
+            }
+            connection.input.erase(0, connection.input.size() - pending.size());
+            if (connection.output.size() - connection.sent >= max_pending) {
+                connection.reading = false;  // Let the peer read its results first
+                break;
+            }
+        }
+        if (!connection.reading && connection.closing && !connection.input.empty() &&
+            connection.input.size() <= max_line) {
+            execute(connection, connection.input);
+            connection.input.clear();
+        }
+    }
 
-public:
-    // Constructor to initialize account and withdrawal amount
-    Withdrawal(Account* account, double amount) : Transaction(account), amount(amount) {}
+    // Method to execute what a connection has sent and send back the results
+    void receive(Connection& connection) {
+        do {
+            read_commands(connection);
+            if (!flush(connection)) {
+                return;
+            }
+        } while (resume_reading(connection));
+        watch(connection, EPOLL_CTL_MOD);
+    }
 
-    // Method to execute withdrawal transaction
-    bool execute() override {
-        return account->withdraw(amount);
+    // Method to release the results the journal has made durable and send them, keeping
+    // on the parked list only connections that still hold some
+    void release_durable() {
+        std::uint64_t count;
+        [[maybe_unused]] ssize_t n = ::read(durable_fd, &count, sizeof(count));
+        std::uint64_t durable = atm.durable_lsn();  // Read after the eventfd, so no fsync is missed
+        releasing.swap(parked);  // Connections that hold results again re-park themselves
+        for (int fd : releasing) {
+            Connection* connection = connections[fd].get();
+            if (connection == nullptr || !connection->parked) {
+                continue;  // Closed since it was parked
+            }
+            connection->parked = false;
+            auto first_held = std::find_if(connection->holds.begin(), connection->holds.end(),
+                                           [durable](const Hold& hold) { return hold.lsn > durable; });
+            if (first_held != connection->holds.begin()) {
+                connection->holds.erase(connection->holds.begin(), first_held);
+                send_pending(*connection);
+                connection = connections[fd].get();
+            }
+            if (connection != nullptr && !connection->holds.empty() && !connection->parked) {
+                connection->parked = true;
+                parked.push_back(fd);
+            }
+        }
+        releasing.clear();
     }
-};
 
-// ATM Class: Handles ATM interactions and transactions
-class ATM {
-private:
-    std::unordered_map<std::string, Account*> accounts;  // Private member to store accounts
+    // Method to send pending output once the socket has room, resuming reads once drained
+    void send_pending(Connection& connection) {
+        if (!flush(connection)) {
+            return;
+        }
+        if (resume_reading(connection)) {
+            receive(connection);
+            return;
+        }
+        watch(connection, EPOLL_CTL_MOD);
+    }
 
 public:
-    // Method to add account to ATM
-    void add_account(Account* account) {
-        accounts[account->get_account_number()] = account;
-    }
+    // Constructor to prepare a server for an ATM
+    explicit TerminalServer(ATM& atm) : atm(atm) {}
 
-    // Method to verify account PIN
-    Account* verify_pin(const std::string& account_number, const std::string& pin) {
-        auto it = accounts.find(account_number);
-        if (it != accounts.end() && it->second->verify_pin(pin)) {
-            return it->second;
+    TerminalServer(const TerminalServer&) = delete;
+    TerminalServer& operator=(const TerminalServer&) = delete;
+
+    ~TerminalServer() {
+        for (std::unique_ptr<Connection>& connection : connections) {
+            if (connection) {
+                ::close(connection->fd);
+            }
+        }
+        for (int fd : {listen_fd, epoll_fd, wake_fd}) {  // durable_fd belongs to the journal
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        if (!unix_path.empty()) {
+            ::unlink(unix_path.c_str());
         }
-        return nullptr;
     }
 
-    // Method to select and execute transaction
-    std::string select_transaction(Account* account, const std::string& transaction_type, double amount = 0) {
-        Transaction* transaction = nullptr;
-        if (transaction_type == "deposit") {
-            transaction = new Deposit(account, amount);
-        } else if (transaction_type == "withdraw") {
-            transaction = new Withdrawal(account, amount);
+    // Method to start listening. An address starting with '/' or "unix:" names a Unix
+    // socket; otherwise it is "port", "ipv4-address:port" or "[ipv6-address]:port", and a
+    // bare port listens on the loopback interface only. Also raises the descriptor limit as far as allowed,
+    // since every terminal holds one.
+    bool listen(std::string_view address) {
+        rlimit limit;
+        if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            ::setrlimit(RLIMIT_NOFILE, &limit);
+        }
+        if (address.starts_with("unix:")) {
+            address.remove_prefix(5);
+        }
+        if (address.starts_with("/")) {
+            sockaddr_un local{};
+            if (address.size() >= sizeof(local.sun_path)) {
+                return false;
+            }
+            local.sun_family = AF_UNIX;
+            std::memcpy(local.sun_path, address.data(), address.size());
+            listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            unix_path = std::string(address);
+            ::unlink(unix_path.c_str());
+            if (listen_fd < 0 || ::bind(listen_fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+                return false;
+            }
         } else {
-            return "Invalid transaction type";
+            sockaddr_storage storage{};
+            sockaddr_in& inet = reinterpret_cast<sockaddr_in&>(storage);
+            sockaddr_in6& inet6 = reinterpret_cast<sockaddr_in6&>(storage);
+            socklen_t size = sizeof(inet);
+            inet.sin_family = AF_INET;
+            inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            std::size_t colon = address.rfind(':');
+            if (colon != std::string_view::npos) {
+                std::string_view host = address.substr(0, colon);
+                if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+                    std::string text(host.substr(1, host.size() - 2));
+                    inet6.sin6_family = AF_INET6;
+                    size = sizeof(inet6);
+                    if (::inet_pton(AF_INET6, text.c_str(), &inet6.sin6_addr) != 1) {
+                        return false;
+                    }
+                } else if (::inet_pton(AF_INET, std::string(host).c_str(), &inet.sin_addr) != 1) {
+                    return false;
+                }
+                address.remove_prefix(colon + 1);
+            }
+            std::uint16_t port = 0;
+            auto [end, error] = std::from_chars(address.data(), address.data() + address.size(), port);
+            if (error != std::errc() || end != address.data() + address.size()) {
+                return false;
+            }
+            (storage.ss_family == AF_INET6 ? inet6.sin6_port : inet.sin_port) = htons(port);
+            listen_fd = ::socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            if (listen_fd < 0 || ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+                ::bind(listen_fd, reinterpret_cast<sockaddr*>(&storage), size) != 0) {
+                return false;
+            }
         }
+        epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (::listen(listen_fd, SOMAXCONN) != 0 || epoll_fd < 0 || wake_fd < 0) {
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = listen_tag;
+        ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+        event.data.u64 = wake_tag;
+        ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+        durable_fd = atm.durable_events();
+        if (durable_fd >= 0) {
+            event.data.u64 = durable_tag;
+            ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, durable_fd, &event);
+        }
+        return true;
+    }
 
-        bool success = transaction->execute();
-        delete transaction;
-        return success ? "Transaction successful" : "Transaction failed";
+    // Method to run the event loop until stop is called
+    ServerStats run() {
+        std::array<epoll_event, 256> events;
+        while (true) {
+            int ready = ::epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), -1);
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready < 0) {
+                break;
+            }
+            for (int i = 0; i < ready; ++i) {
+                std::uint64_t tag = events[i].data.u64;
+                if (tag == wake_tag) {
+                    return stats;
+                }
+                if (tag == listen_tag) {
+                    accept_connections();
+                    continue;
+                }
+                if (tag == durable_tag) {
+                    release_durable();
+                    continue;
+                }
+                Connection* connection = connections[tag].get();
+                if (connection == nullptr) {
+                    continue;  // Closed earlier in this round
+                }
+                if (connection->reading && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                    receive(*connection);
+                } else if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                    send_pending(*connection);
+                }
+            }
+        }
+        return stats;
     }
 
-    // Method to check account balance
-    double check_balance(Account* account) const {
-        return account->check_balance();
+    // Method to make run return. Only writes to an eventfd, so it is safe to call from
+    // another thread or from a signal handler.
+    void stop() {
+        std::uint64_t one = 1;
+        [[maybe_unused]] ssize_t n = ::write(wake_fd, &one, sizeof(one));
     }
 };
 
@@ -143,6 +5404,103 @@ void clear_input_buffer() {
     std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 }
 
+// Function to print statement lines
+void display_statement_lines(const StatementLine* lines, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+        const StatementLine& line = lines[i];
+        std::time_t seconds = static_cast<std::time_t>(line.time_ns / 1000000000);
+        std::tm local;
+        char when[32];
+        localtime_r(&seconds, &local);
+        std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+        const char* kind = line.type == TransactionType::Deposit      ? "Deposit"
+                           : line.type == TransactionType::Withdrawal ? "Withdrawal"
+                           : line.type == TransactionType::Transfer   ? "Transfer"
+                                                                      : "Interest";
+        std::cout << when << "  " << std::left << std::setw(10) << kind << std::right << "  " << line.amount
+                  << "  balance " << line.balance << "\n";
+    }
+}
+
+// Function to print a mini statement, newest transaction first
+void display_mini_statement(const std::array<StatementLine, HistoryRing::capacity>& lines, std::size_t count) {
+    if (count == 0) {
+        std::cout << "No recent transactions.\n";
+        return;
+    }
+    std::cout << "Recent transactions:\n";
+    display_statement_lines(lines.data(), count);
+}
+
+// Function to print a statement, oldest transaction first
+void display_statement(const Statement& statement) {
+    std::cout << "Opening balance: " << statement.opening << "\n";
+    display_statement_lines(statement.lines.data(), statement.lines.size());
+    std::cout << "Closing balance: " << statement.closing << "\n";
+}
+
+// Function to print a reconciliation report, listing only the shards that do not balance
+void display_reconcile_report(const ReconcileReport& report) {
+    const ReconcileShard& totals = report.totals;
+    std::cout << "Reconciled " << report.accounts << " accounts (" << report.snapshot_accounts
+              << " from snapshot) and " << report.records << " journal records up to LSN " << report.cut_lsn
+              << " in " << report.seconds * 1000 << " ms using " << report.workers << " threads\n";
+    std::cout << "Opening " << format_cents(totals.opening) << " + deposits " << format_cents(totals.deposits)
+              << " - withdrawals " << format_cents(totals.withdrawals) << " + interest "
+              << format_cents(totals.interest) << " = expected " << format_cents(totals.expected()) << ", closing "
+              << format_cents(totals.closing) << "\n";
+    if (report.unknown > 0) {
+        std::cout << report.unknown << " journal records name unknown accounts or types\n";
+    }
+    for (std::size_t s = 0; s < report.shards.size(); ++s) {
+        const ReconcileShard& shard = report.shards[s];
+        if (shard.discrepancy() != 0) {
+            std::cout << "Shard " << s << " (accounts " << (s << ReconcileShard::shard_bits) << "-"
+                      << std::min<std::uint64_t>(((s + 1) << ReconcileShard::shard_bits), report.accounts) - 1
+                      << "): expected " << format_cents(shard.expected()) << ", closing "
+                      << format_cents(shard.closing) << ", off by " << format_cents(shard.discrepancy()) << "\n";
+        }
+    }
+    std::cout << (report.balanced() ? "Ledger balances\n" : "Ledger does NOT balance\n");
+}
+
+// Function to print what an interest run credited and how fast the kernel went
+void display_interest_stats(const InterestStats& stats) {
+    std::cout << "Credited " << stats.total << " interest to " << stats.credited << " of " << stats.accounts
+              << " accounts";
+    if (stats.failed > 0) {
+        std::cout << " (" << stats.failed << " refused, balance would overflow)";
+    }
+    std::cout << " in " << stats.seconds * 1000 << " ms\n"
+              << "Kernel " << stats.kernel << ": " << stats.compute_seconds * 1000 << " ms, "
+              << stats.accounts_per_second / 1e6 << " M accounts/s; transactions paused "
+              << stats.pause_seconds * 1000 << " ms\n";
+}
+
+// Function to print the outcome and cost of a snapshot as one line, so lines from the
+// checkpoint thread do not interleave with other output
+void display_checkpoint_stats(std::ostream& os, const CheckpointStats& stats) {
+    char line[160];
+    if (stats.ok) {
+        std::snprintf(line, sizeof(line),
+                      "Checkpoint of %llu accounts through journal record %llu in %.1f ms, transactions paused %.3f ms\n",
+                      static_cast<unsigned long long>(stats.accounts), static_cast<unsigned long long>(stats.last_lsn),
+                      stats.seconds * 1000, stats.pause_seconds * 1000);
+    } else {
+        std::snprintf(line, sizeof(line), "Checkpoint failed, the journal is kept\n");
+    }
+    os << line << std::flush;
+}
+
+// Function to print the size and accuracy of the account number filter
+void display_filter_stats(std::ostream& os, const BloomStats& stats) {
+    os << "Account filter: " << stats.keys << " of " << stats.capacity << " keys in " << stats.bytes / 1024
+       << " KiB (" << std::setprecision(3) << 8.0 * stats.bytes / std::max<std::uint64_t>(stats.capacity, 1)
+       << " bits/key at capacity), " << stats.fill * 100 << "% bits set, estimated false-positive rate "
+       << stats.estimated_fpr * 100 << "%, " << stats.false_positives << " false positives seen\n"
+       << std::setprecision(6);
+}
+
 // Function to display the main menu
 void display_main_menu() {
     std::cout << "============================\n";
@@ -151,20 +5509,1134 @@ void display_main_menu() {
     std::cout << "1. Check Balance\n";
     std::cout << "2. Deposit\n";
     std::cout << "3. Withdraw\n";
-    std::cout << "4. Exit\n";
+    std::cout << "4. Mini Statement\n";
+    std::cout << "5. Monthly Statement\n";
+    std::cout << "6. Exit\n";
     std::cout << "============================\n";
     std::cout << "Please select an option: ";
 }
 
-int main() {
-    // Create accounts
-    Account account1("123456", "1234", 1000);
-    Account account2("654321", "4321", 500);
+// Function to count the operator new calls the calling thread makes while f runs
+template <typename F>
+std::uint64_t count_allocations(F&& f) {
+    std::uint64_t before = thread_allocations;
+    f();
+    return thread_allocations - before;
+}
+
+// Function to add count accounts numbered from 10000000 upwards, each holding balance
+void add_test_accounts(ATM& atm, std::size_t count, Money balance) {
+    atm.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        atm.add_account(std::to_string(10000000 + i), "1234", balance);
+    }
+}
+
+// Function to create an empty scratch directory under TMPDIR (or /tmp); returns an empty
+// string on failure
+std::string make_scratch_directory() {
+    const char* base = std::getenv("TMPDIR");
+    std::string path = std::string(base && *base ? base : "/tmp") + "/atm-XXXXXX";
+    return ::mkdtemp(path.data()) ? path : std::string();
+}
+
+// Function to build count random deposits and withdrawals spread over accounts
+std::vector<TxRequest> random_requests(std::size_t count, std::size_t accounts, std::uint64_t seed) {
+    std::mt19937_64 random(seed);
+    std::vector<TxRequest> requests(count);
+    for (TxRequest& request : requests) {
+        request.account = static_cast<AccountId>(random() % accounts);
+        request.type = random() % 2 ? TransactionType::Deposit : TransactionType::Withdrawal;
+        request.amount = Money::from_cents(static_cast<std::int64_t>(random() % 5000 + 1));
+        request.result = TransactionResult::Failed;
+    }
+    return requests;
+}
+
+// Function to run the built-in checks, printing one PASS or FAIL line per check; returns
+// whether all of them passed
+bool run_selftest(std::ostream& os) {
+    bool passed = true;
+    // Function to report one check
+    auto check = [&](const char* name, bool ok) {
+        os << (ok ? "PASS " : "FAIL ") << name << "\n";
+        passed = passed && ok;
+    };
+
+    // Amounts parse to exact cents and refuse anything that does not fit
+    {
+        Money amount;
+        check("amounts parse to exact cents", Money::parse("19.9", amount) && amount == Money::from_cents(1990) &&
+                                                  Money::parse("92233720368547758.07", amount) && amount == Money::max());
+        check("amounts that overflow are refused",
+              !Money::parse("92233720368547758.08", amount) && !Money::parse("92233720368547758.99", amount) &&
+                  !Money::parse("92233720368547759", amount));
+    }
+
+    // The transaction path must not touch the heap once the ledger is set up
+    {
+        ATM atm;
+        Account first = atm.add_account("100001", "1111", Money::from_units(100));
+        atm.add_account("100002", "2222", Money::from_units(100));
+        AuthStatus status;
+        Session session = atm.authenticate("100002", "2222", 1, status);
+        bool ok = first && session;
+        for (int i = 0; i < 100; ++i) {
+            atm.select_transaction(first, TransactionType::Deposit, Money::from_cents(1));
+            atm.select_transaction(first, TransactionType::Withdrawal, Money::from_cents(1));
+        }
+        std::uint64_t allocations = count_allocations([&] {
+            for (int i = 0; i < 10000; ++i) {
+                ok = ok && atm.select_transaction(first, TransactionType::Deposit, Money::from_cents(250)) ==
+                               TransactionResult::Success;
+                ok = ok && atm.select_transaction(first, TransactionType::Withdrawal, Money::from_cents(150)) ==
+                               TransactionResult::Success;
+                ok = ok && atm.select_transaction(session, TransactionType::Deposit, Money::from_cents(5)) ==
+                               TransactionResult::Success;
+                ok = ok && atm.check_balance(first) > Money() && atm.check_balance(session) > Money();
+                ok = ok && atm.select_transaction(first, TransactionType::Transfer, Money::from_cents(1)) ==
+                               TransactionResult::InvalidType;
+                ok = ok && atm.verify_pin("100001", "1111");
+            }
+        });
+        check("deposits, withdrawals, balances and PIN checks make no heap allocation", allocations == 0);
+        check("transactions give the expected results", ok);
+        check("balances add up after the transactions",
+              atm.check_balance(first) == Money::from_units(10100) && atm.check_balance(session) == Money::from_units(600));
+    }
+
+    // Failed PINs lock only the terminal they were entered at, plus its peer address once
+    // that has seen peer_limit failures
+    {
+        ATM atm;
+        atm.add_account("100001", "1111", Money::from_units(100));
+        AuthStatus status;
+        LockoutPolicy policy;
+        for (std::uint32_t i = 0; i <= policy.terminal_limit; ++i) {
+            atm.authenticate("999999", "0000", 1, status);
+        }
+        check("a numbered terminal locks after terminal_limit failures", status == AuthStatus::TerminalLocked);
+        check("numbered terminals do not share counters",
+              atm.authenticate("100001", "1111", 1 + 4096, status) && atm.authenticate("100001", "1111", 2, status));
+        std::uint64_t peer = 0;
+        std::vector<std::uint64_t> terminals(policy.peer_limit / policy.terminal_limit + 1);
+        for (std::uint64_t& terminal : terminals) {
+            for (std::uint32_t i = 0; i < policy.terminal_limit; ++i) {
+                atm.authenticate("999999", "0000", TerminalCounters{&terminal, &peer}, status);
+            }
+        }
+        std::uint64_t fresh = 0;
+        check("a peer address locks after peer_limit failures across its terminals",
+              !atm.authenticate("100001", "1111", TerminalCounters{&fresh, &peer}, status) &&
+                  status == AuthStatus::TerminalLocked &&
+                  atm.authenticate("100001", "1111", TerminalCounters{&fresh, nullptr}, status));
+    }
+
+    // Batched PIN checks give the answers of single checks, and every SHA-256 kernel gives
+    // the standard's digest
+    {
+        const std::size_t accounts = 40;
+        ATM atm;
+        std::vector<Account> handles;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            handles.push_back(atm.add_account(std::to_string(300000 + i), std::to_string(1000 + i)));
+        }
+        std::mt19937_64 random(19);
+        std::vector<PinAttempt> attempts(203);  // Not a whole number of lanes or groups
+        std::vector<std::string> entered(attempts.size());
+        for (std::size_t i = 0; i < attempts.size(); ++i) {
+            std::size_t account = random() % accounts;
+            entered[i] = std::to_string(random() % 3 ? 1000 + account : 9000 + account);
+            attempts[i].account = random() % 10 ? handles[account] : Account();
+            PinCode::from_string(entered[i], attempts[i].pin);
+        }
+        std::size_t matched = atm.verify_pins(attempts);
+        std::size_t expected = 0;
+        bool same = true;
+        for (std::size_t i = 0; i < attempts.size(); ++i) {
+            bool single = attempts[i].account && attempts[i].account.verify_pin(entered[i]);
+            same = same && attempts[i].valid == single;
+            expected += single;
+        }
+        check("batched PIN checks match single checks", same && matched == expected && expected > 0);
+
+        alignas(64) std::uint8_t blocks[4][64] = {{'a', 'b', 'c', 0x80}};
+        blocks[0][63] = 24;
+        std::uint32_t scalar[4][8], chosen[4][8], lanes[4][8];
+        PinHash::start_state(scalar[0]);
+        sha256_compress_scalar(scalar[0], blocks[0]);
+        static constexpr std::uint32_t abc[8] = {0xba7816bf, 0x8f01cfea, 0x414140de, 0x5dae2223,
+                                                 0xb00361a3, 0x96177a9c, 0xb410ff61, 0xf20015ad};
+        bool agree = std::memcmp(scalar[0], abc, sizeof(abc)) == 0;
+        for (int round = 0; round < 16; ++round) {
+            std::uint32_t* lane_states[4];
+            const std::uint8_t* lane_blocks[4];
+            for (int l = 0; l < 4; ++l) {
+                if (round > 0 || l > 0) {
+                    for (std::uint8_t& byte : blocks[l]) {
+                        byte = static_cast<std::uint8_t>(random());
+                    }
+                }
+                PinHash::start_state(scalar[l]);
+                PinHash::start_state(chosen[l]);
+                PinHash::start_state(lanes[l]);
+                sha256_compress_scalar(scalar[l], blocks[l]);
+                PinHash::compress()(chosen[l], blocks[l]);
+                lane_states[l] = lanes[l];
+                lane_blocks[l] = blocks[l];
+            }
+            if (PinHash::batched()) {
+                sha256_compress_shani_lanes<4>(lane_states, lane_blocks);
+            } else {
+                std::memcpy(lanes, scalar, sizeof(lanes));
+            }
+            agree = agree && std::memcmp(scalar, chosen, sizeof(scalar)) == 0 &&
+                    std::memcmp(scalar, lanes, sizeof(scalar)) == 0;
+        }
+        check("SHA-256 kernels agree with the scalar kernel and the standard", agree);
+    }
+
+    // A batch must give every request the result it would get run on its own, in order
+    {
+        constexpr std::size_t accounts = 1000;
+        ATM atm;
+        add_test_accounts(atm, accounts, Money::from_units(20));
+        std::vector<TxRequest> requests = random_requests(100000, accounts, 1);
+        requests[17].account = static_cast<AccountId>(accounts);  // No such account
+        requests[18].type = TransactionType::Transfer;            // Needs a destination
+        std::vector<std::int64_t> expected_balances(accounts, Money::from_units(20).to_cents());
+        std::vector<TransactionResult> expected_results;
+        for (const TxRequest& request : requests) {
+            TransactionResult result = TransactionResult::InvalidType;
+            if (request.account >= accounts) {
+                result = TransactionResult::InvalidAccount;
+            } else if (request.type == TransactionType::Deposit) {
+                expected_balances[request.account] += request.amount.to_cents();
+                result = TransactionResult::Success;
+            } else if (request.type == TransactionType::Withdrawal) {
+                bool covered = expected_balances[request.account] >= request.amount.to_cents();
+                expected_balances[request.account] -= covered ? request.amount.to_cents() : 0;
+                result = covered ? TransactionResult::Success : TransactionResult::Failed;
+            }
+            expected_results.push_back(result);
+        }
+        atm.execute_batch(requests);
+        bool results_match = true;
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            results_match = results_match && requests[i].result == expected_results[i];
+        }
+        bool balances_match = true;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            balances_match = balances_match && atm.find_account(std::to_string(10000000 + i)).check_balance() ==
+                                                   Money::from_cents(expected_balances[i]);
+        }
+        check("execute_batch gives each request its in-order result", results_match);
+        check("execute_batch leaves the balances of in-order execution", balances_match);
+    }
+
+    // Transfers check their accounts, never overdraw, and conserve money under contention
+    {
+        constexpr std::size_t accounts = 8;
+        ATM atm;
+        add_test_accounts(atm, accounts, Money::from_units(100));
+        Account first = atm.find_account("10000000");
+        Account second = atm.find_account("10000001");
+        check("transfer moves money between accounts",
+              atm.transfer(first, second, Money::from_units(30)) == TransactionResult::Success &&
+                  first.check_balance() == Money::from_units(70) && second.check_balance() == Money::from_units(130));
+        check("transfer refuses to overdraw",
+              atm.transfer(first, second, Money::from_units(71)) == TransactionResult::Failed &&
+                  first.check_balance() == Money::from_units(70));
+        check("transfer refuses a missing account",
+              atm.transfer(Account(), second, Money::from_units(1)) == TransactionResult::InvalidAccount &&
+                  atm.transfer(first, Account(), Money::from_units(1)) == TransactionResult::InvalidAccount &&
+                  atm.transfer(first, atm.find_account("99999999"), Money::from_units(1)) ==
+                      TransactionResult::InvalidAccount);
+        check("transfer refuses an account to itself", atm.transfer(first, first, Money::from_units(1)) ==
+                                                           TransactionResult::Failed);
+
+        // Opposite transfers between the same accounts would deadlock without ordered locking
+        std::atomic<bool> overdrawn{false};
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < 4; ++t) {
+            threads.emplace_back([&, t] {
+                std::mt19937 random(t);
+                for (int i = 0; i < 20000; ++i) {
+                    Account from = atm.find_account(std::to_string(10000000 + random() % accounts));
+                    Account to = atm.find_account(std::to_string(10000000 + (t % 2 ? 0 : 1)));
+                    atm.transfer(from, to, Money::from_cents(random() % 3000 + 1));
+                    overdrawn = overdrawn || from.check_balance() < Money();
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        Money total;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            total += atm.find_account(std::to_string(10000000 + i)).check_balance();
+        }
+        check("concurrent transfers conserve money and never overdraw",
+              total == Money::from_units(100 * accounts) && !overdrawn);
+    }
+
+    // Deposits and withdrawals racing on a few shared accounts: every CAS retry must leave
+    // the total at the opening balances plus the net of the transactions that succeeded
+    {
+        const std::size_t accounts = 8;
+        const unsigned threads_used = std::max(8u, std::thread::hardware_concurrency());
+        ATM atm;
+        add_test_accounts(atm, accounts, Money::from_units(10));
+        std::vector<Account> handles;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            handles.push_back(atm.find_account(std::to_string(10000000 + i)));
+        }
+        std::atomic<std::int64_t> net{0};
+        std::atomic<bool> negative{false};
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < threads_used; ++t) {
+            threads.emplace_back([&, t] {
+                std::mt19937 random(100 + t);
+                std::int64_t moved = 0;
+                for (int i = 0; i < 50000; ++i) {
+                    Account account = handles[random() % accounts];
+                    bool deposit = random() % 2 == 0;
+                    std::int64_t cents = random() % 2000 + 1;
+                    if (atm.select_transaction(account, deposit ? TransactionType::Deposit : TransactionType::Withdrawal,
+                                               Money::from_cents(cents)) == TransactionResult::Success) {
+                        moved += deposit ? cents : -cents;
+                    }
+                    negative = negative || account.check_balance() < Money();
+                }
+                net += moved;
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        Money total;
+        for (Account& account : handles) {
+            total += account.check_balance();
+            negative = negative || account.check_balance() < Money();
+        }
+        check("concurrent deposits and withdrawals conserve money and never go negative",
+              total == Money::from_units(10 * accounts) + Money::from_cents(net) && !negative);
+    }
+
+    // The thread-per-core ledger runs the same transactions and hands the balances back
+    {
+        constexpr std::size_t accounts = 100;
+        ATM atm;
+        add_test_accounts(atm, accounts, Money::from_units(10));
+        AccountId first = atm.find_account("10000005").get_id();
+        AccountId second = atm.find_account("10000007").get_id();
+        std::atomic<std::uint64_t> failures{0};
+        {
+            std::unique_ptr<PartitionedLedger> ledger = atm.partition(3);
+            check("partitioned ledger runs deposits, withdrawals and balance checks",
+                  ledger->deposit(first, Money::from_cents(250)) && ledger->withdraw(second, Money::from_units(4)) &&
+                      !ledger->withdraw(second, Money::from_units(7)) &&
+                      ledger->check_balance(first) == Money::from_cents(1250));
+            check("partitioned ledger refuses accounts it does not own",
+                  !ledger->deposit(static_cast<AccountId>(accounts), Money::from_units(1)) &&
+                      !ledger->withdraw(static_cast<AccountId>(accounts), Money::from_units(1)) &&
+                      ledger->check_balance(static_cast<AccountId>(accounts)) == Money());
+            std::vector<std::thread> threads;
+            for (unsigned t = 0; t < 4; ++t) {
+                threads.emplace_back([&, t] {
+                    std::mt19937 random(t);
+                    for (int i = 0; i < 20000; ++i) {
+                        AccountId id = static_cast<AccountId>(random() % accounts);
+                        if (!ledger->deposit(id, Money::from_cents(3)) || !ledger->withdraw(id, Money::from_cents(2))) {
+                            ++failures;
+                        }
+                    }
+                });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+        }
+        Money total;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            total += atm.find_account(std::to_string(10000000 + i)).check_balance();
+        }
+        check("partitioned ledger hands every balance back when it stops",
+              failures == 0 && atm.check_balance(atm.find_account("10000007")) >= Money::from_units(6) &&
+                  total == Money::from_units(10 * accounts) + Money::from_cents(250 - 400 + 4 * 20000));
+    }
+
+    // Accounts opened with a journal attached come back after a crash under their own ids,
+    // whether a checkpoint covers them or only the journal does
+    {
+        std::string directory = make_scratch_directory();
+        bool ok = !directory.empty();
+        AccountId opened_id = 0;
+        {
+            ATM atm;
+            atm.add_account("123456", "1234", Money::from_units(1000));
+            Journal journal;
+            ok = ok && journal.open(directory) && atm.attach_journal(&journal);
+            Account before = atm.add_account("700001", "7001", Money::from_units(50));
+            ok = ok && atm.select_transaction(before, TransactionType::Deposit, Money::from_units(25)) ==
+                           TransactionResult::Success;
+            ok = ok && atm.checkpoint().ok;
+            Account after = atm.add_account("700002", "7002", Money::from_units(20));
+            ok = ok && atm.select_transaction(after, TransactionType::Withdrawal, Money::from_units(5)) ==
+                           TransactionResult::Success;
+            opened_id = after.get_id();
+        }
+        ATM atm;
+        atm.add_account("123456", "1234", Money::from_units(1000));
+        ReplayStats recovered = atm.recover(directory);
+        Journal journal;
+        ok = ok && journal.open(directory, JournalOptions(), recovered.last_lsn + 1) && atm.attach_journal(&journal);
+        check("recovery recreates accounts opened since the last checkpoint",
+              ok && recovered.opened == 1 && recovered.skipped == 0 &&
+                  atm.find_account("700001").check_balance() == Money::from_units(75) &&
+                  atm.find_account("700002").check_balance() == Money::from_units(15) &&
+                  atm.find_account("700002").get_id() == opened_id && atm.verify_pin("700002", "7002"));
+        Account next = atm.add_account("700003", "7003", Money::from_units(1));
+        check("accounts opened after recovery get fresh ids", next && next.get_id() == opened_id + 1);
+        check("recovered accounts reconcile", atm.reconcile().balanced());
+        journal.close();
+        std::filesystem::remove_all(directory);
+    }
+
+    // Replay gives every account its live balance whatever the number of workers, with
+    // transfers whose two sides belong to different workers
+    {
+        const std::size_t accounts = 40;
+        std::string directory = make_scratch_directory();
+        bool ok = !directory.empty();
+        std::vector<Money> live(accounts);
+        {
+            ATM atm;
+            add_test_accounts(atm, accounts, Money::from_units(100));
+            Journal journal;
+            ok = ok && journal.open(directory) && atm.attach_journal(&journal);
+            std::vector<Account> handles;
+            for (std::size_t i = 0; i < accounts; ++i) {
+                handles.push_back(atm.find_account(std::to_string(10000000 + i)));
+            }
+            for (const TxRequest& request : random_requests(3000, accounts, 5)) {
+                atm.select_transaction(handles[request.account], request.type, request.amount);
+                Account to = handles[(request.account * 7 + 3) % accounts];
+                atm.transfer(handles[request.account], to, Money::from_cents(request.amount.to_cents() / 3));
+            }
+            for (std::size_t i = 0; i < accounts; ++i) {
+                live[i] = handles[i].check_balance();
+            }
+        }
+        for (unsigned workers : {1u, 3u, 8u}) {
+            ATM atm;
+            add_test_accounts(atm, accounts, Money::from_units(100));
+            ReplayStats recovered = atm.recover(directory, workers);
+            bool same = recovered.skipped == 0 && recovered.records > 3000;
+            for (std::size_t i = 0; i < accounts; ++i) {
+                same = same && atm.find_account(std::to_string(10000000 + i)).check_balance() == live[i];
+            }
+            Journal journal;
+            ok = ok && same && journal.open(directory, JournalOptions(), recovered.last_lsn + 1) &&
+                 atm.attach_journal(&journal) && atm.reconcile().balanced();
+            journal.close();
+        }
+        check("replay matches live balances with one or several workers", ok);
+        std::filesystem::remove_all(directory);
+    }
+
+    // The ledger's requests are not journaled, so it must not run beside a journal
+    {
+        std::string directory = make_scratch_directory();
+        ATM atm;
+        add_test_accounts(atm, 10, Money::from_units(10));
+        Journal journal;
+        check("partitioned ledger is refused while a journal is attached",
+              !directory.empty() && journal.open(directory) && atm.attach_journal(&journal) &&
+                  atm.partition(3) == nullptr);
+        journal.close();
+        std::filesystem::remove_all(directory);
+    }
+    return passed;
+}
+
+// Function to time f, in seconds
+template <typename F>
+double time_seconds(F&& f) {
+    auto started = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+// Function to call f(i) for i from 0 to count - 1, timing each call on its own, and
+// return the latency that the given fraction of the calls stayed within, in nanoseconds
+template <typename F>
+double latency_percentile_ns(std::size_t count, double fraction, F&& f) {
+    std::vector<std::int64_t> samples(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        auto started = std::chrono::steady_clock::now();
+        f(i);
+        samples[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started)
+                         .count();
+    }
+    auto rank = samples.begin() + std::min<std::size_t>(count - 1, static_cast<std::size_t>(fraction * count));
+    std::nth_element(samples.begin(), rank, samples.end());
+    return static_cast<double>(*rank);
+}
+
+// Function to run the built-in benchmarks and print their throughput
+void run_benchmark(std::ostream& os) {
+    constexpr std::size_t accounts = 100000;
+    constexpr std::size_t count = 2000000;
+
+    // Back-office feed: one execute_batch call against a select_transaction loop
+    {
+        std::vector<TxRequest> requests = random_requests(count, accounts, 2);
+        ATM looped;
+        add_test_accounts(looped, accounts, Money::from_units(100));
+        double loop_seconds = time_seconds([&] {
+            for (TxRequest& request : requests) {
+                request.result = looped.select_transaction(looped.find_account(std::to_string(10000000 + request.account)),
+                                                           request.type, request.amount);
+            }
+        });
+        std::vector<Account> handles;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            handles.push_back(looped.find_account(std::to_string(10000000 + i)));
+        }
+        double handle_seconds = time_seconds([&] {
+            for (TxRequest& request : requests) {
+                request.result = looped.select_transaction(handles[request.account], request.type, request.amount);
+            }
+        });
+        ATM batched;
+        add_test_accounts(batched, accounts, Money::from_units(100));
+        double batch_seconds = time_seconds([&] { batched.execute_batch(requests); });
+        os << "Batch of " << count << " requests over " << accounts << " accounts:\n"
+           << "  select_transaction loop, looking up each account: " << count / loop_seconds / 1e6 << " M/s\n"
+           << "  select_transaction loop, account handles ready:   " << count / handle_seconds / 1e6 << " M/s\n"
+           << "  execute_batch:                                     " << count / batch_seconds / 1e6 << " M/s\n";
+    }
+
+    // Transfers under contention: most touching one hot account, or spread uniformly
+    {
+        unsigned threads_used = std::max(4u, std::thread::hardware_concurrency());
+        constexpr std::size_t transfers_per_thread = 250000;
+        ATM atm;
+        add_test_accounts(atm, accounts, Money::from_units(1000000));
+        std::vector<Account> handles;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            handles.push_back(atm.find_account(std::to_string(10000000 + i)));
+        }
+        // Function to run transfers on every thread, picking the accounts with pick(random)
+        auto run = [&](auto pick) {
+            return time_seconds([&] {
+                std::vector<std::thread> threads;
+                for (unsigned t = 0; t < threads_used; ++t) {
+                    threads.emplace_back([&, t] {
+                        std::mt19937_64 random(t);
+                        for (std::size_t i = 0; i < transfers_per_thread; ++i) {
+                            auto [from, to] = pick(random);
+                            atm.transfer(handles[from], handles[to], Money::from_cents(1));
+                        }
+                    });
+                }
+                for (std::thread& thread : threads) {
+                    thread.join();
+                }
+            });
+        };
+        double hot_seconds = run([](std::mt19937_64& random) {
+            std::size_t other = 1 + random() % (accounts - 1);
+            return random() % 2 ? std::pair(std::size_t(0), other) : std::pair(other, std::size_t(0));
+        });
+        double uniform_seconds = run([](std::mt19937_64& random) {
+            std::size_t from = random() % accounts;
+            return std::pair(from, (from + 1 + random() % (accounts - 1)) % accounts);
+        });
+        double total = double(threads_used) * transfers_per_thread;
+        os << "Transfers on " << threads_used << " threads:\n"
+           << "  every transfer touching one hot account: " << total / hot_seconds / 1e6 << " M/s\n"
+           << "  uniformly random accounts:               " << total / uniform_seconds / 1e6 << " M/s\n";
+    }
+
+    // The same deposits and withdrawals on shared accounts updated with CAS, and sent to
+    // the owning core of a partitioned ledger
+    {
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        unsigned threads_used = std::max(4u, cores);
+        constexpr std::size_t operations_per_thread = 250000;
+        ATM atm;
+        add_test_accounts(atm, accounts, Money::from_units(1000000));
+        std::vector<Account> handles;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            handles.push_back(atm.find_account(std::to_string(10000000 + i)));
+        }
+        // Function to run the workload on every thread, calling op(account, deposit)
+        auto run = [&](auto op) {
+            return time_seconds([&] {
+                std::vector<std::thread> threads;
+                for (unsigned t = 0; t < threads_used; ++t) {
+                    threads.emplace_back([&, t] {
+                        std::mt19937_64 random(t);
+                        for (std::size_t i = 0; i < operations_per_thread; ++i) {
+                            op(static_cast<AccountId>(random() % accounts), i % 2 == 0);
+                        }
+                    });
+                }
+                for (std::thread& thread : threads) {
+                    thread.join();
+                }
+            });
+        };
+        double shared_seconds = run([&](AccountId id, bool deposit) {
+            atm.select_transaction(handles[id], deposit ? TransactionType::Deposit : TransactionType::Withdrawal,
+                                   Money::from_cents(1));
+        });
+        double partitioned_seconds;
+        {
+            std::unique_ptr<PartitionedLedger> ledger = atm.partition(cores);
+            partitioned_seconds = run([&](AccountId id, bool deposit) {
+                deposit ? ledger->deposit(id, Money::from_cents(1)) : ledger->withdraw(id, Money::from_cents(1));
+            });
+        }
+        double total = double(threads_used) * operations_per_thread;
+        os << "Deposits and withdrawals on " << threads_used << " threads:\n"
+           << "  shared accounts updated with CAS:             " << total / shared_seconds / 1e6 << " M/s\n"
+           << "  partitioned ledger, one owner per core:      " << total / partitioned_seconds / 1e6 << " M/s ("
+           << cores << " cores)\n";
+    }
+
+    // Committed deposits per second through a group-commit journal at several group
+    // windows: each thread waits for its deposit to be on disk before the next
+    {
+        unsigned threads_used = std::max(32u, std::thread::hardware_concurrency());
+        constexpr std::size_t journaled_accounts = 10000;
+        os << "Journaled deposits on " << threads_used << " threads, committed per second:\n";
+        for (std::chrono::microseconds window : {std::chrono::microseconds(0), std::chrono::microseconds(100),
+                                                 std::chrono::microseconds(500), std::chrono::microseconds(2000)}) {
+            std::string directory = make_scratch_directory();
+            ATM atm;
+            add_test_accounts(atm, journaled_accounts, Money::from_units(100));
+            std::vector<Account> handles;
+            for (std::size_t i = 0; i < journaled_accounts; ++i) {
+                handles.push_back(atm.find_account(std::to_string(10000000 + i)));
+            }
+            JournalOptions options;
+            options.group_window = window;
+            Journal journal;
+            if (directory.empty() || !journal.open(directory, options) || !atm.attach_journal(&journal)) {
+                os << "  cannot open a journal in a scratch directory\n";
+                break;
+            }
+            std::atomic<bool> stop{false};
+            std::atomic<std::uint64_t> committed{0};
+            double seconds = time_seconds([&] {
+                std::vector<std::thread> threads;
+                for (unsigned t = 0; t < threads_used; ++t) {
+                    threads.emplace_back([&, t] {
+                        std::mt19937_64 random(t);
+                        std::uint64_t done = 0;
+                        while (!stop.load(std::memory_order_relaxed)) {
+                            done += atm.select_transaction(handles[random() % journaled_accounts],
+                                                           TransactionType::Deposit,
+                                                           Money::from_cents(1)) == TransactionResult::Success;
+                        }
+                        committed += done;
+                    });
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                stop = true;
+                for (std::thread& thread : threads) {
+                    thread.join();
+                }
+            });
+            journal.close();
+            std::filesystem::remove_all(directory);
+            os << "  group window " << std::setw(4) << window.count() << " us: " << committed / seconds / 1e3
+               << " k/s\n";
+        }
+    }
+
+    // Deposits per second through an asynchronous journal, alone and while checkpoints
+    // are taken back to back
+    {
+        unsigned threads_used = std::max(4u, std::thread::hardware_concurrency());
+        std::string directory = make_scratch_directory();
+        ATM atm;
+        add_test_accounts(atm, accounts, Money::from_units(100));
+        std::vector<Account> handles;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            handles.push_back(atm.find_account(std::to_string(10000000 + i)));
+        }
+        JournalOptions options;
+        options.durability = Durability::Async;
+        Journal journal;
+        if (directory.empty() || !journal.open(directory, options) || !atm.attach_journal(&journal)) {
+            os << "Cannot open a journal in a scratch directory\n";
+        } else {
+            // Function to return the deposits per second made on every thread in half a
+            // second, while background(stop) runs on one more
+            auto run = [&](auto background) {
+                std::atomic<bool> stop{false};
+                std::atomic<std::uint64_t> deposits{0};
+                double seconds = time_seconds([&] {
+                    std::vector<std::thread> threads;
+                    for (unsigned t = 0; t < threads_used; ++t) {
+                        threads.emplace_back([&, t] {
+                            std::mt19937_64 random(t);
+                            std::uint64_t done = 0;
+                            while (!stop.load(std::memory_order_relaxed)) {
+                                done += atm.select_transaction(handles[random() % accounts], TransactionType::Deposit,
+                                                               Money::from_cents(1)) == TransactionResult::Success;
+                            }
+                            deposits += done;
+                        });
+                    }
+                    std::thread side([&] { background(stop); });
+                    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                    stop = true;
+                    for (std::thread& thread : threads) {
+                        thread.join();
+                    }
+                    side.join();
+                });
+                return deposits / seconds;
+            };
+            double quiet = run([](std::atomic<bool>&) {});
+            std::vector<CheckpointStats> taken;
+            double during = run([&](std::atomic<bool>& stop) {
+                while (!stop.load(std::memory_order_relaxed)) {
+                    taken.push_back(atm.checkpoint());
+                }
+            });
+            double longest_pause = 0, total_seconds = 0;
+            for (const CheckpointStats& stats : taken) {
+                longest_pause = std::max(longest_pause, stats.pause_seconds);
+                total_seconds += stats.seconds;
+            }
+            os << "Deposits on " << threads_used << " threads with an asynchronous journal:\n"
+               << "  no checkpoint:            " << quiet / 1e6 << " M/s\n"
+               << "  checkpoints back to back: " << during / 1e6 << " M/s (" << taken.size() << " checkpoints of "
+               << accounts << " accounts, " << total_seconds * 1000 / std::max<std::size_t>(taken.size(), 1)
+               << " ms each, longest pause " << longest_pause * 1000 << " ms)\n";
+            journal.close();
+        }
+        if (!directory.empty()) {
+            std::filesystem::remove_all(directory);
+        }
+    }
+
+    // PIN checks one at a time against the same attempts checked in batches
+    {
+        constexpr std::size_t pin_accounts = 10000;
+        constexpr std::size_t checks = 1000000;
+        ATM atm;
+        std::vector<Account> handles;
+        for (std::size_t i = 0; i < pin_accounts; ++i) {
+            handles.push_back(atm.add_account(std::to_string(10000000 + i), "1234"));
+        }
+        std::vector<PinAttempt> attempts(checks);
+        std::mt19937_64 random(19);
+        for (PinAttempt& attempt : attempts) {
+            attempt.account = handles[random() % pin_accounts];
+            PinCode::from_string(random() % 2 ? "1234" : "4321", attempt.pin);
+        }
+        std::size_t single_matched = 0, batch_matched = 0;
+        double single_seconds = time_seconds([&] {
+            for (PinAttempt& attempt : attempts) {
+                single_matched += atm.verify_pins(std::span<PinAttempt>(&attempt, 1));
+            }
+        });
+        double batch_seconds = time_seconds([&] { batch_matched = atm.verify_pins(attempts); });
+        os << "PIN checks of " << checks << " attempts (" << PinHash::kernel_name() << " kernel):\n"
+           << "  one at a time: " << checks / single_seconds / 1e6 << " M/s\n"
+           << "  batched:       " << checks / batch_seconds / 1e6 << " M/s"
+           << (single_matched == batch_matched ? "" : " (results differ)") << "\n";
+    }
+
+    // Lookups by account number in the flat sharded index against the node-based map the
+    // ATM used to keep, at several table sizes
+    {
+        constexpr std::size_t lookups = 1000000;
+        constexpr std::size_t latency_samples = 200000;
+        os << "Account lookups of random existing numbers, flat index against std::unordered_map:\n";
+        for (std::size_t size : {std::size_t(10000), std::size_t(100000), std::size_t(1000000)}) {
+            ATM atm;
+            add_test_accounts(atm, size, Money());
+            std::unordered_map<std::string, AccountId> map;
+            for (std::size_t i = 0; i < size; ++i) {
+                map.emplace(std::to_string(10000000 + i), static_cast<AccountId>(i));
+            }
+            std::mt19937_64 random(size);
+            std::vector<std::string> numbers(lookups);
+            for (std::string& number : numbers) {
+                number = std::to_string(10000000 + random() % size);
+            }
+            std::uint64_t found = 0;
+            auto index_lookup = [&](std::size_t i) { found += atm.find_account(numbers[i]).get_id(); };
+            auto map_lookup = [&](std::size_t i) { found += map.find(numbers[i])->second; };
+            double index_seconds = time_seconds([&] {
+                for (std::size_t i = 0; i < lookups; ++i) {
+                    index_lookup(i);
+                }
+            });
+            double map_seconds = time_seconds([&] {
+                for (std::size_t i = 0; i < lookups; ++i) {
+                    map_lookup(i);
+                }
+            });
+            double index_p99 = latency_percentile_ns(latency_samples, 0.99, index_lookup);
+            double map_p99 = latency_percentile_ns(latency_samples, 0.99, map_lookup);
+            os << "  " << std::setw(7) << size << " accounts: index " << lookups / index_seconds / 1e6 << " M/s, p99 "
+               << index_p99 << " ns; map " << lookups / map_seconds / 1e6 << " M/s, p99 " << map_p99 << " ns"
+               << (found == 0 ? " (nothing found)" : "") << "\n";
+        }
+    }
+
+    // PIN checks on the sharded account table from 1 to 64 threads, with one account
+    // opened for every 64 checks
+    {
+        ATM atm;
+        add_test_accounts(atm, accounts, Money());
+        os << "PIN checks with account openings mixed in, by thread count:\n";
+        for (unsigned threads_used : {1u, 2u, 4u, 8u, 16u, 32u, 64u}) {
+            std::atomic<bool> stop{false};
+            std::atomic<std::uint64_t> operations{0};
+            double seconds = time_seconds([&] {
+                std::vector<std::thread> threads;
+                for (unsigned t = 0; t < threads_used; ++t) {
+                    threads.emplace_back([&, t] {
+                        std::mt19937_64 random(t);
+                        std::uint64_t done = 0, opened = 0;
+                        while (!stop.load(std::memory_order_relaxed)) {
+                            if (++done % 64 == 0) {
+                                atm.add_account(std::to_string(30000000 + t * 100000 + opened++), "1234");
+                            } else {
+                                atm.verify_pin(std::to_string(10000000 + random() % accounts), "1234");
+                            }
+                        }
+                        operations += done;
+                    });
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                stop = true;
+                for (std::thread& thread : threads) {
+                    thread.join();
+                }
+            });
+            os << "  " << std::setw(2) << threads_used << " threads: " << operations / seconds / 1e6 << " M/s\n";
+        }
+    }
+
+    // Size of the transaction history per transaction, and the time to build a monthly
+    // statement from it
+    {
+        constexpr std::size_t history_accounts = 1000;
+        constexpr std::size_t transactions = 1000000;
+        constexpr std::size_t statements = 20000;
+        std::string directory = make_scratch_directory();
+        ATM atm;
+        add_test_accounts(atm, history_accounts, Money::from_units(1000000));
+        std::vector<Account> handles;
+        for (std::size_t i = 0; i < history_accounts; ++i) {
+            handles.push_back(atm.find_account(std::to_string(10000000 + i)));
+        }
+        JournalOptions options;
+        options.durability = Durability::Async;
+        Journal journal;
+        if (directory.empty() || !journal.open(directory, options) || !atm.attach_journal(&journal)) {
+            os << "Cannot open a journal in a scratch directory\n";
+        } else {
+            for (const TxRequest& request : random_requests(transactions, history_accounts, 16)) {
+                atm.select_transaction(handles[request.account], request.type, request.amount);
+            }
+            // A checkpoint waits until the history holds every transaction and writes it out
+            bool written = atm.checkpoint().ok;
+            std::error_code ec;
+            std::uintmax_t disk_bytes = std::filesystem::file_size(directory + "/history.dat", ec) +
+                                        std::filesystem::file_size(directory + "/history.idx", ec);
+            std::time_t now = std::time(nullptr);
+            std::tm today{};
+            ::gmtime_r(&now, &today);
+            std::mt19937_64 random(16);
+            std::size_t lines = 0;
+            Statement statement;
+            auto build = [&](std::size_t) {
+                atm.statement(handles[random() % history_accounts], today.tm_year + 1900, today.tm_mon + 1,
+                              statement);
+                lines += statement.lines.size();
+            };
+            double seconds = time_seconds([&] {
+                for (std::size_t i = 0; i < statements; ++i) {
+                    build(i);
+                }
+            });
+            double p99 = latency_percentile_ns(statements, 0.99, build);
+            os << "History of " << transactions << " transactions over " << history_accounts << " accounts"
+               << (written ? "" : " (checkpoint failed)") << ":\n"
+               << "  on disk:   " << double(disk_bytes) / transactions << " bytes per transaction\n"
+               << "  in memory: " << double(atm.history_bytes()) / transactions << " bytes per transaction\n"
+               << "  monthly statement of " << lines / std::max<std::size_t>(2 * statements, 1)
+               << " lines: " << seconds / statements * 1e6 << " us mean, p99 " << p99 / 1000 << " us\n";
+            journal.close();
+        }
+        if (!directory.empty()) {
+            std::filesystem::remove_all(directory);
+        }
+    }
+
+    // Lookups where nine in ten account numbers do not exist, as with mistyped or scraped
+    // numbers, which the Bloom filter turns away before any shard is locked
+    {
+        constexpr std::size_t lookups = 1000000;
+        constexpr std::size_t latency_samples = 200000;
+        ATM atm;
+        add_test_accounts(atm, accounts, Money());
+        std::unordered_map<std::string, AccountId> map;
+        for (std::size_t i = 0; i < accounts; ++i) {
+            map.emplace(std::to_string(10000000 + i), static_cast<AccountId>(i));
+        }
+        std::mt19937_64 random(21);
+        std::vector<std::string> hits(lookups), mixed(lookups);
+        for (std::size_t i = 0; i < lookups; ++i) {
+            hits[i] = std::to_string(10000000 + random() % accounts);
+            mixed[i] = random() % 10 == 0 ? hits[i] : std::to_string(20000000 + random() % 10000000);
+        }
+        std::uint64_t found = 0;
+        auto hit_lookup = [&](std::size_t i) { found += static_cast<bool>(atm.find_account(hits[i])); };
+        auto mixed_lookup = [&](std::size_t i) { found += static_cast<bool>(atm.find_account(mixed[i])); };
+        auto map_lookup = [&](std::size_t i) { found += map.count(mixed[i]); };
+        // Function to print the rate and p99 latency of lookup over every number
+        auto report = [&](const char* name, auto lookup) {
+            double seconds = time_seconds([&] {
+                for (std::size_t i = 0; i < lookups; ++i) {
+                    lookup(i);
+                }
+            });
+            os << name << lookups / seconds / 1e6 << " M/s, p99 " << latency_percentile_ns(latency_samples, 0.99, lookup)
+               << " ns\n";
+        };
+        os << "Account lookups over " << accounts << " accounts:\n";
+        report("  every number exists:              ", hit_lookup);
+        report("  90% unknown numbers:              ", mixed_lookup);
+        report("  90% unknown, std::unordered_map:  ", map_lookup);
+        os << "  ";
+        display_filter_stats(os, atm.account_filter_stats());
+        if (found == 0) {
+            os << "  (nothing found)\n";
+        }
+    }
+
+    // Heap memory per account: packed keys and flat per-account columns, against the
+    // heap-allocated account objects behind a string-keyed map the ATM used to keep
+    {
+        constexpr std::size_t measured = 1000000;
+        // Function to return the bytes of heap in use, including large mmap()ed blocks
+        auto heap_bytes = [] {
+            struct mallinfo2 info = ::mallinfo2();
+            return info.uordblks + info.hblkhd;
+        };
+        std::size_t before = heap_bytes();
+        std::size_t packed;
+        {
+            ATM atm;
+            add_test_accounts(atm, measured, Money::from_units(100));
+            packed = heap_bytes() - before;
+        }
+        // The account as it was: number, PIN and balance in an object of its own
+        struct LegacyAccount {
+            std::string account_number;
+            std::string pin;
+            double balance;
+        };
+        before = heap_bytes();
+        std::size_t legacy;
+        {
+            std::unordered_map<std::string, std::unique_ptr<LegacyAccount>> map;
+            for (std::size_t i = 0; i < measured; ++i) {
+                std::string number = std::to_string(10000000 + i);
+                auto account = std::make_unique<LegacyAccount>(LegacyAccount{number, "1234", 100.0});
+                map.emplace(std::move(number), std::move(account));
+            }
+            legacy = heap_bytes() - before;
+        }
+        before = heap_bytes();
+        std::size_t string_index;
+        {
+            std::unordered_map<std::string, AccountId> map;
+            for (std::size_t i = 0; i < measured; ++i) {
+                map.emplace(std::to_string(10000000 + i), static_cast<AccountId>(i));
+            }
+            string_index = heap_bytes() - before;
+        }
+        constexpr std::size_t record = sizeof(AccountKey) + sizeof(PinHash) + sizeof(std::int64_t) +
+                                       sizeof(std::uint8_t) + sizeof(std::uint32_t) + sizeof(std::uint64_t);
+        constexpr std::size_t ring = sizeof(HistoryRing);
+        double index = double(packed) / measured - record - ring;
+        os << "Heap memory per account with " << measured << " accounts:\n"
+           << "  string-keyed map of account objects (number, PIN, balance): " << double(legacy) / measured
+           << " bytes\n"
+           << "  ATM: " << double(packed) / measured << " bytes, made of\n"
+           << "    number, PIN hash, balance, product, version and failure count: " << record << " bytes\n"
+           << "    recent transactions for mini statements:                        " << ring << " bytes\n"
+           << "    number index, Bloom filter and spare capacity:                  " << index << " bytes\n"
+           << "  number index as std::unordered_map<std::string, AccountId>:     "
+           << double(string_index) / measured << " bytes\n";
+    }
+}
 
+int main(int argc, char* argv[]) {
     // Create ATM and add accounts
     ATM atm;
-    atm.add_account(&account1);
-    atm.add_account(&account2);
+    atm.add_account("123456", "1234", Money::from_units(1000));
+    atm.add_account("654321", "4321", Money::from_units(500));
+
+    // Optional: load accounts from a snapshot file with "--snapshot <file>", journal
+    // transactions to disk with "--journal <directory>" and snapshot the ledger every few
+    // seconds with "--checkpoint <seconds>". "--reconcile" checks the recovered ledger
+    // against the snapshot and journal, prints the report and exits. "--batch <file>"
+    // runs a script of commands ("-" reads standard input) instead of the menu, writing
+    // one result line per command to standard output. "--listen <address>" serves many
+    // terminals over a TCP port or Unix socket with the same commands until interrupted.
+    // "--interest <percent>" credits a day's interest at that yearly rate to every
+    // account, journaled like any transaction, prints what it did and exits.
+    // "--selftest" runs the built-in checks and exits with 1 if any of them fails;
+    // "--benchmark" prints the throughput of the execution modes and exits.
+    std::string snapshot_file;
+    std::string journal_directory;
+    std::string batch_file;
+    std::string listen_address;
+    long checkpoint_seconds = 0;
+    bool reconcile = false;
+    bool selftest = false;
+    bool benchmark = false;
+    double interest_percent = -1;
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "--reconcile") {
+            reconcile = true;
+        } else if (option == "--selftest") {
+            selftest = true;
+        } else if (option == "--benchmark") {
+            benchmark = true;
+        } else if (i + 1 == argc) {
+            break;
+        } else if (option == "--snapshot") {
+            snapshot_file = argv[++i];
+        } else if (option == "--journal") {
+            journal_directory = argv[++i];
+        } else if (option == "--checkpoint") {
+            checkpoint_seconds = std::atol(argv[++i]);
+        } else if (option == "--batch") {
+            batch_file = argv[++i];
+        } else if (option == "--listen") {
+            listen_address = argv[++i];
+        } else if (option == "--interest") {
+            interest_percent = std::strtod(argv[++i], nullptr);
+        }
+    }
+
+    if (selftest) {
+        return run_selftest(std::cout) ? 0 : 1;
+    }
+    if (benchmark) {
+        run_benchmark(std::cout);
+        return 0;
+    }
+
+    // Batch results own standard output, so progress messages go to standard error
+    std::ostream& log = batch_file.empty() ? std::cout : std::cerr;
+
+    if (!snapshot_file.empty()) {
+        auto started = std::chrono::steady_clock::now();
+        SnapshotHeader header;
+        if (!atm.load_snapshot(snapshot_file, header)) {
+            std::cerr << "Cannot load snapshot " << snapshot_file << "\n";
+            return 1;
+        }
+        log << "Mapped " << header.accounts << " accounts in "
+            << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count()
+            << " ms\n";
+    }
+
+    Journal journal;
+    std::unique_ptr<Checkpointer> checkpointer;
+    if (!journal_directory.empty()) {
+        ReplayStats recovered = atm.recover(journal_directory);
+        log << "Recovered " << (recovered.snapshot ? recovered.snapshot_accounts : 0)
+            << " accounts from snapshot, " << recovered.opened << " opened since and " << recovered.records
+            << " journal records from " << recovered.segments << " segments in " << recovered.seconds * 1000 << " ms using "
+            << recovered.workers << " threads\n";
+        if (!journal.open(journal_directory, JournalOptions(), recovered.last_lsn + 1)) {
+            std::cerr << "Cannot open journal in " << journal_directory << "\n";
+            return 1;
+        }
+        if (!atm.attach_journal(&journal)) {
+            std::cerr << "Cannot open the transaction history in " << journal_directory << "\n";
+            return 1;
+        }
+        if (reconcile) {
+            ReconcileReport report = atm.reconcile();
+            if (!report.ok) {
+                std::cerr << "Cannot read the snapshot or journal in " << journal_directory << "\n";
+                return 1;
+            }
+            display_reconcile_report(report);
+            display_filter_stats(std::cout, atm.account_filter_stats());
+            return report.balanced() ? 0 : 2;
+        }
+        if (checkpoint_seconds > 0) {
+            checkpointer = std::make_unique<Checkpointer>(atm, std::chrono::seconds(checkpoint_seconds),
+                                                          [&log](const CheckpointStats& stats) {
+                                                              display_checkpoint_stats(log, stats);
+                                                          });
+        }
+    }
+
+    if (interest_percent >= 0) {
+        InterestRates rates;
+        for (unsigned product = 0; product < rates.daily.size(); ++product) {
+            rates.set_annual_percent(static_cast<std::uint8_t>(product), interest_percent);
+        }
+        display_interest_stats(atm.accrue_interest(rates));
+        return 0;
+    }
+
+    if (!batch_file.empty()) {
+        int fd = batch_file == "-" ? STDIN_FILENO : ::open(batch_file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Cannot open batch file " << batch_file << "\n";
+            return 1;
+        }
+        BatchStats stats = run_batch(atm, fd, STDOUT_FILENO);
+        if (fd != STDIN_FILENO) {
+            ::close(fd);
+        }
+        log << "Executed " << stats.commands << " commands in " << stats.seconds * 1000 << " ms\n";
+        display_filter_stats(log, atm.account_filter_stats());
+        return stats.ok ? 0 : 1;
+    }
+
+    if (!listen_address.empty()) {
+        static TerminalServer* running_server = nullptr;
+        TerminalServer server(atm);
+        if (!server.listen(listen_address)) {
+            std::cerr << "Cannot listen on " << listen_address << "\n";
+            return 1;
+        }
+        running_server = &server;
+        struct sigaction action{};
+        action.sa_handler = [](int) { running_server->stop(); };
+        ::sigaction(SIGINT, &action, nullptr);
+        ::sigaction(SIGTERM, &action, nullptr);
+        std::cout << "Listening on " << listen_address << std::endl;
+        ServerStats stats = server.run();
+        std::cout << "Served " << stats.commands << " commands over " << stats.connections
+                  << " connections, at most " << stats.peak_connections << " at once\n";
+        display_filter_stats(std::cout, atm.account_filter_stats());
+        return 0;
+    }
 
     while (true) {
         std::string account_number, pin;
@@ -173,8 +6645,9 @@ int main() {
         std::cout << "Enter PIN: ";
         std::cin >> pin;
 
-        Account* account = atm.verify_pin(account_number, pin);
-        if (account) {
+        AuthStatus status;
+        Session session = atm.authenticate(account_number, pin, 0, status);
+        if (session) {
             int choice;
             do {
                 display_main_menu();
@@ -183,25 +6656,58 @@ int main() {
 
                 switch (choice) {
                 case 1:
-                    std::cout << "Your balance is: " << atm.check_balance(account) << "\n";
+                    std::cout << "Your balance is: " << atm.check_balance(session) << "\n";
                     break;
                 case 2: {
-                    double amount;
+                    std::string input;
+                    Money amount;
                     std::cout << "Enter amount to deposit: ";
-                    std::cin >> amount;
+                    std::cin >> input;
                     clear_input_buffer();
-                    std::cout << atm.select_transaction(account, "deposit", amount) << "\n";
+                    if (!Money::parse(input, amount)) {
+                        std::cout << "Invalid amount. Please try again.\n";
+                        break;
+                    }
+                    std::cout << to_message(atm.select_transaction(session, TransactionType::Deposit, amount)) << "\n";
                     break;
                 }
                 case 3: {
-                    double amount;
+                    std::string input;
+                    Money amount;
                     std::cout << "Enter amount to withdraw: ";
-                    std::cin >> amount;
+                    std::cin >> input;
+                    clear_input_buffer();
+                    if (!Money::parse(input, amount)) {
+                        std::cout << "Invalid amount. Please try again.\n";
+                        break;
+                    }
+                    std::cout << to_message(atm.select_transaction(session, TransactionType::Withdrawal, amount)) << "\n";
+                    break;
+                }
+                case 4: {
+                    std::array<StatementLine, HistoryRing::capacity> lines;
+                    display_mini_statement(lines, atm.mini_statement(session, lines));
+                    break;
+                }
+                case 5: {
+                    if (!atm.keeps_history()) {
+                        std::cout << "Statements need a journal (--journal).\n";
+                        break;
+                    }
+                    int year = 0;
+                    int month = 0;
+                    Statement statement;
+                    std::cout << "Enter year and month (e.g. 2024 3, month 0 for the whole year): ";
+                    std::cin >> year >> month;
                     clear_input_buffer();
-                    std::cout << atm.select_transaction(account, "withdraw", amount) << "\n";
+                    if (!atm.statement(session, year, month, statement)) {
+                        std::cout << "Invalid month. Please try again.\n";
+                        break;
+                    }
+                    display_statement(statement);
                     break;
                 }
-                case 4:
+                case 6:
                     std::cout << "Thank you for using the ATM. Goodbye!\n";
                     break;
                 default:
@@ -209,8 +6715,12 @@ int main() {
                     break;
                 }
                 std::cout << "\n";
-            } while (choice != 4);
+            } while (choice != 6);
             break;
+        } else if (status == AuthStatus::AccountLocked) {
+            std::cout << "Too many failed attempts. This account is locked, please try again later.\n";
+        } else if (status == AuthStatus::TerminalLocked) {
+            std::cout << "Too many failed attempts. This terminal is locked, please try again later.\n";
         } else {
             std::cout << "Invalid account number or PIN. Please try again.\n";
         }